@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "config.h"
+#include "stats.h"
+
+#define CGROUP_DAEMON "unshd-daemon"
+#define CGROUP_JOBS "unshd-jobs"
+
+// parent of the pipeline cgroups, -1 when they are not used
+static int jobsfd = -1;
+// where the daemon and jobs cgroups are, kept for cgroup_cleanup()
+static int basefd = -1;
+// controllers we enabled there, and must disable again to move back
+static bool enabled[3];
+static unsigned long nextid = 0;
+// cgroups of jobs that were over while some of their processes were still around
+static char **leftover = NULL;
+static size_t nleftover = 0;
+
+static int write_file(int dirfd, const char *name, const char *value) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = write(fd, value, strlen(value));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ret < 0 ? -1 : 0;
+}
+
+static ssize_t read_file(int dirfd, const char *name, char *buf, size_t size) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = read(fd, buf, size - 1);
+    close(fd);
+    if (ret < 0) {
+        return -1;
+    }
+    buf[ret] = 0;
+    return ret;
+}
+
+// where cgroup2 is mounted, it is not /sys/fs/cgroup on hybrid systems
+static char *cgroup2_mount(void) {
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    if (!f) {
+        return NULL;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    char *ret = NULL;
+    while (!ret && getline(&line, &cap, f) >= 0) {
+        char *sep = strstr(line, " - ");
+        if (!sep || strncmp(sep + 3, "cgroup2 ", 8)) {
+            continue;
+        }
+        // id parent dev root mountpoint ...
+        char *field = line;
+        for (int i = 0; i < 4 && field; i++) {
+            field = strchr(field, ' ');
+            if (field) {
+                field++;
+            }
+        }
+        if (field) {
+            ret = strndup(field, strcspn(field, " "));
+        }
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+static char *own_cgroup(void) {
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    if (!f) {
+        return NULL;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    char *ret = NULL;
+    while (!ret && getline(&line, &cap, f) >= 0) {
+        if (!strncmp(line, "0::", 3)) {
+            ret = strndup(line + 3, strcspn(line + 3, "\n"));
+        }
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+static const char *const controllers[] = {"cpu", "memory", "pids"};
+
+static bool has_word(const char *list, const char *word) {
+    size_t len = strlen(word);
+    for (const char *p = strstr(list, word); p; p = strstr(p + 1, word)) {
+        if ((p == list || p[-1] == ' ') && (!p[len] || p[len] == ' ' || p[len] == '\n')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// controllers that are not delegated to us only cost their limits, accounting stays
+// returns in done[] those that were not enabled before
+static void enable_controllers(int dirfd, bool *done) {
+    char before[256] = "";
+    read_file(dirfd, "cgroup.subtree_control", before, sizeof(before));
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        char change[16];
+        snprintf(change, sizeof(change), "+%s", controllers[i]);
+        if (write_file(dirfd, "cgroup.subtree_control", change) == 0 && done) {
+            done[i] = !has_word(before, controllers[i]);
+        }
+    }
+}
+
+int cgroup_init(void) {
+    char *mount = cgroup2_mount();
+    char *own = own_cgroup();
+    int daemonfd = -1;
+    if (!mount || !own) {
+        fprintf(stderr, "no cgroup2 hierarchy, pipelines run in unshd's cgroup\n");
+        goto out;
+    }
+    // a restarted unshd is still in the cgroup of the one before it
+    size_t len = strlen(own), leaflen = strlen("/" CGROUP_DAEMON);
+    if (len >= leaflen && !strcmp(own + len - leaflen, "/" CGROUP_DAEMON)) {
+        own[len - leaflen] = 0;
+    }
+    char *path;
+    if (asprintf(&path, "%s%s", mount, own) < 0) {
+        goto out;
+    }
+    basefd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(path);
+    // only leaves may hold processes once controllers are enabled, so unshd gets its own
+    if (basefd < 0 ||
+        (mkdirat(basefd, CGROUP_DAEMON, 0755) < 0 && errno != EEXIST) ||
+        (daemonfd = openat(basefd, CGROUP_DAEMON, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        write_file(daemonfd, "cgroup.procs", "0") < 0 ||
+        (mkdirat(basefd, CGROUP_JOBS, 0755) < 0 && errno != EEXIST) ||
+        (jobsfd = openat(basefd, CGROUP_JOBS, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "cannot set up cgroups under %s%s (%s), pipelines run in unshd's cgroup\n",
+            mount, own, strerror(errno));
+        goto out;
+    }
+    enable_controllers(basefd, enabled);
+    enable_controllers(jobsfd, NULL);
+
+out:
+    if (daemonfd >= 0) {
+        close(daemonfd);
+    }
+    if (jobsfd < 0 && basefd >= 0) {
+        close(basefd);
+        basefd = -1;
+    }
+    free(mount);
+    free(own);
+    return jobsfd < 0 ? -1 : 0;
+}
+
+void cgroup_cleanup(void) {
+    if (jobsfd < 0) {
+        return;
+    }
+    // also those an unshd that did not get to clean up left behind
+    DIR *dir = fdopendir(jobsfd);
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            if (!strncmp(ent->d_name, "job-", 4)) {
+                unlinkat(jobsfd, ent->d_name, AT_REMOVEDIR);
+            }
+        }
+        closedir(dir);
+    } else {
+        close(jobsfd);
+    }
+    jobsfd = -1;
+    // processes of pipelines still running keep it, and so unshd's own cgroup
+    if (unlinkat(basefd, CGROUP_JOBS, AT_REMOVEDIR) < 0) {
+        fprintf(stderr, "cannot remove cgroup %s: %s\n", CGROUP_JOBS, strerror(errno));
+        return;
+    }
+    // with controllers enabled, processes are not allowed back in the parent
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (enabled[i]) {
+            char change[16];
+            snprintf(change, sizeof(change), "-%s", controllers[i]);
+            write_file(basefd, "cgroup.subtree_control", change);
+        }
+    }
+    if (write_file(basefd, "cgroup.procs", "0") < 0 || unlinkat(basefd, CGROUP_DAEMON, AT_REMOVEDIR) < 0) {
+        fprintf(stderr, "cannot remove cgroup %s: %s\n", CGROUP_DAEMON, strerror(errno));
+    }
+    close(basefd);
+    basefd = -1;
+}
+
+bool cgroup_enabled(void) {
+    return jobsfd >= 0;
+}
+
+void cgroup_default_limits(unsh_cglimits *limits) {
+    strcpy(limits->cpu_weight, UNSH_CGROUP_CPU_WEIGHT);
+    strcpy(limits->memory_max, UNSH_CGROUP_MEMORY_MAX);
+    strcpy(limits->pids_max, UNSH_CGROUP_PIDS_MAX);
+}
+
+// both unshd processes of a restart create cgroups in the same place
+static void cgroup_name(char *buf, size_t size, unsigned long id) {
+    snprintf(buf, size, "job-%ld-%lu", (long)getpid(), id);
+}
+
+int cgroup_new(const unsh_cglimits *limits, unsigned long *id) {
+    if (jobsfd < 0) {
+        return -1;
+    }
+    char name[48];
+    unsigned long newid = ++nextid;
+    cgroup_name(name, sizeof(name), newid);
+    if (mkdirat(jobsfd, name, 0755) < 0) {
+        perror("cannot create pipeline cgroup");
+        return -1;
+    }
+    int ret = openat(jobsfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ret < 0) {
+        perror("cannot open pipeline cgroup");
+        unlinkat(jobsfd, name, AT_REMOVEDIR);
+        return -1;
+    }
+    // the files of missing controllers do not exist, the pipeline just goes without
+    write_file(ret, "cpu.weight", limits->cpu_weight);
+    write_file(ret, "memory.max", limits->memory_max);
+    write_file(ret, "pids.max", limits->pids_max);
+    stats.cgroup_jobs++;
+    *id = newid;
+    return ret;
+}
+
+void cgroup_enter(int cgfd) {
+    int fd = openat(cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        // if this fails the stage runs in unshd's cgroup
+        (void)write(fd, "0", 1);
+        close(fd);
+    }
+}
+
+static unsigned long long stat_field(const char *buf, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : p) {
+        if (!strncmp(p, name, len) && p[len] == ' ') {
+            return strtoull(p + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+int cgroup_usage(int cgfd, unsh_cgusage *usage) {
+    char buf[1024];
+    memset(usage, 0, sizeof(*usage));
+    if (read_file(cgfd, "cpu.stat", buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    usage->usage_us = stat_field(buf, "usage_usec");
+    usage->user_us = stat_field(buf, "user_usec");
+    usage->system_us = stat_field(buf, "system_usec");
+    if (read_file(cgfd, "memory.peak", buf, sizeof(buf)) > 0) {
+        usage->memory_peak = strtoull(buf, NULL, 10);
+    }
+    stats.cgroup_cpu_us += usage->usage_us;
+    return 0;
+}
+
+void cgroup_release(int cgfd, unsigned long id) {
+    char name[48];
+    close(cgfd);
+    // processes that left the pipeline's process group keep the cgroup busy
+    for (size_t i = 0; i < nleftover;) {
+        if (!unlinkat(jobsfd, leftover[i], AT_REMOVEDIR) || errno != EBUSY) {
+            free(leftover[i]);
+            leftover[i] = leftover[--nleftover];
+        } else {
+            i++;
+        }
+    }
+    cgroup_name(name, sizeof(name), id);
+    if (unlinkat(jobsfd, name, AT_REMOVEDIR) < 0 && errno == EBUSY) {
+        char **newleftover = realloc(leftover, (nleftover + 1) * sizeof(char *));
+        if (newleftover) {
+            leftover = newleftover;
+            leftover[nleftover++] = strdup(name);
+        }
+    }
+}
+
+void cgroup_scale_weight(unsh_cglimits *limits, int percent) {
+    unsigned long weight = strtoul(limits->cpu_weight, NULL, 10) * percent / 100;
+    snprintf(limits->cpu_weight, sizeof(limits->cpu_weight), "%lu", weight ? weight : 1);
+}
+
+char *cgroup_limit_field(unsh_cglimits *limits, const char *name, const char *value) {
+    char *field;
+    unsigned long long min;
+    if (!strcmp(name, "cpu.weight")) {
+        field = limits->cpu_weight;
+        min = 1;
+    } else if (!strcmp(name, "memory.max")) {
+        field = limits->memory_max;
+        min = 0;
+    } else if (!strcmp(name, "pids.max")) {
+        field = limits->pids_max;
+        min = 0;
+    } else {
+        return NULL;
+    }
+    if (!value) {
+        return field;
+    }
+    if (!strcmp(value, "max")) {
+        // there is no unlimited weight
+        return field == limits->cpu_weight ? NULL : field;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (!*value || *value == '-' || *end || errno || n < min ||
+        (field == limits->cpu_weight && n > 10000) || strlen(value) >= sizeof(limits->cpu_weight)) {
+        return NULL;
+    }
+    return field;
+}
+
+size_t cgroup_format_usage(const unsh_cgusage *usage, char *buf, size_t size) {
+    int len = snprintf(buf, size, "cpu %llu.%03llus user %llu.%03llus sys %llu.%03llus",
+        usage->usage_us / 1000000, usage->usage_us / 1000 % 1000,
+        usage->user_us / 1000000, usage->user_us / 1000 % 1000,
+        usage->system_us / 1000000, usage->system_us / 1000 % 1000);
+    if (len >= 0 && (size_t)len < size && usage->memory_peak) {
+        len += snprintf(buf + len, size - len, " mem %lluk", usage->memory_peak / 1024);
+    }
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
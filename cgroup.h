@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// one cgroup v2 child per pipeline, next to a leaf holding unshd itself
+// so that the daemon keeps its share of CPU however busy its pipelines are
+// without a writable cgroup2 hierarchy, pipelines run in unshd's cgroup
+// only used when unshd is started with -g
+
+typedef struct unsh_cglimits {
+    char cpu_weight[24];
+    char memory_max[24];
+    char pids_max[24];
+} unsh_cglimits;
+
+typedef struct unsh_cgusage {
+    unsigned long long usage_us;
+    unsigned long long user_us;
+    unsigned long long system_us;
+    // 0 if the memory controller is not available
+    unsigned long long memory_peak;
+} unsh_cgusage;
+
+// per session, allocated on first use
+typedef struct unsh_cgsession {
+    unsh_cglimits limits;
+    // last pipeline of the session that is over
+    unsh_cgusage last;
+    bool haslast;
+} unsh_cgsession;
+
+int cgroup_init(void);
+// move unshd back where it was and remove the cgroups, unless pipelines are still running
+void cgroup_cleanup(void);
+bool cgroup_enabled(void);
+void cgroup_default_limits(unsh_cglimits *limits);
+// returns a directory fd for a new pipeline cgroup and its id, or -1 to run without
+int cgroup_new(const unsh_cglimits *limits, unsigned long *id);
+// move the calling process into the cgroup, async-signal-safe for use after fork()
+void cgroup_enter(int cgfd);
+int cgroup_usage(int cgfd, unsh_cgusage *usage);
+// close the cgroup and remove it, or retry later if processes remain
+void cgroup_release(int cgfd, unsigned long id);
+// cpu.weight is cut to this percentage, for batch pipelines
+void cgroup_scale_weight(unsh_cglimits *limits, int percent);
+// checks the value of a limit, returns its field or NULL
+char *cgroup_limit_field(unsh_cglimits *limits, const char *name, const char *value);
+size_t cgroup_format_usage(const unsh_cgusage *usage, char *buf, size_t size);
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "chunk.h"
+
+// maximum number of queued chunks handed to a single writev()
+#define OUTQ_IOV_MAX 64
+
+unsh_chunk *chunk_new(size_t size) {
+    unsh_chunk *ret = malloc(sizeof(unsh_chunk) + size);
+    if (!ret) {
+        return NULL;
+    }
+    ret->refcount = 1;
+    ret->len = 0;
+    return ret;
+}
+
+unsh_chunk *chunk_ref(unsh_chunk *chunk) {
+    chunk->refcount++;
+    return chunk;
+}
+
+void chunk_unref(unsh_chunk *chunk) {
+    if (chunk && --chunk->refcount == 0) {
+        free(chunk);
+    }
+}
+
+void outq_push(unsh_outq *q, unsh_chunk *chunk, size_t offset) {
+    unsh_outq_entry *ent = malloc(sizeof(unsh_outq_entry));
+    ent->next = NULL;
+    ent->chunk = chunk_ref(chunk);
+    ent->offset = offset;
+    if (q->tail) {
+        q->tail->next = ent;
+    } else {
+        q->head = ent;
+    }
+    q->tail = ent;
+    q->bytes += chunk->len - offset;
+}
+
+static void outq_pop(unsh_outq *q) {
+    unsh_outq_entry *ent = q->head;
+    q->head = ent->next;
+    if (!q->head) {
+        q->tail = NULL;
+    }
+    chunk_unref(ent->chunk);
+    free(ent);
+}
+
+// write as much of the queue as the fd accepts
+// returns bytes written, or -1 on errors other than EAGAIN
+ssize_t outq_flush(unsh_outq *q, int fd) {
+    ssize_t total = 0;
+    while (q->head) {
+        struct iovec iov[OUTQ_IOV_MAX];
+        int iovcnt = 0;
+        for (unsh_outq_entry *ent = q->head; ent && iovcnt < OUTQ_IOV_MAX; ent = ent->next) {
+            iov[iovcnt].iov_base = ent->chunk->data + ent->offset;
+            iov[iovcnt].iov_len = ent->chunk->len - ent->offset;
+            iovcnt++;
+        }
+
+        ssize_t thiswrite = writev(fd, iov, iovcnt);
+        if (thiswrite < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        total += thiswrite;
+        q->bytes -= thiswrite;
+
+        size_t left = thiswrite;
+        while (q->head && left >= q->head->chunk->len - q->head->offset) {
+            left -= q->head->chunk->len - q->head->offset;
+            outq_pop(q);
+        }
+        if (left) {
+            q->head->offset += left;
+            break;
+        }
+    }
+    return total;
+}
+
+void outq_clear(unsh_outq *q) {
+    while (q->head) {
+        outq_pop(q);
+    }
+    q->bytes = 0;
+}
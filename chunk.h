@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// refcounted output buffer, read once from a pipeline and shared by every subscriber
+typedef struct unsh_chunk {
+    unsigned refcount;
+    size_t len;
+    char data[];
+} unsh_chunk;
+
+typedef struct unsh_outq_entry {
+    struct unsh_outq_entry *next;
+    unsh_chunk *chunk;
+    size_t offset;
+} unsh_outq_entry;
+
+// per-client queue of chunk references waiting for the socket to become writable
+typedef struct unsh_outq {
+    unsh_outq_entry *head;
+    unsh_outq_entry *tail;
+    size_t bytes;
+} unsh_outq;
+
+unsh_chunk *chunk_new(size_t size);
+unsh_chunk *chunk_ref(unsh_chunk *chunk);
+void chunk_unref(unsh_chunk *chunk);
+
+void outq_push(unsh_outq *q, unsh_chunk *chunk, size_t offset);
+ssize_t outq_flush(unsh_outq *q, int fd);
+void outq_clear(unsh_outq *q);
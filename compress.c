@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "config.h"
+#include "protocol.h"
+#include "stats.h"
+
+struct unsh_zout {
+    z_stream zs;
+    // chunks still to be sent uncompressed after incompressible output
+    unsigned bypass;
+    unsigned long long in;
+    unsigned long long out;
+    unsigned long long bypassed;
+    unsigned long long cpu_ns;
+};
+
+static unsigned long long cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsh_zout *zout_new(void) {
+    unsh_zout *z = calloc(1, sizeof(unsh_zout));
+    if (!z) {
+        return NULL;
+    }
+    // raw deflate, the frames already delimit the stream
+    if (deflateInit2(&z->zs, UNSH_COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void zout_free(unsh_zout *z) {
+    if (!z) {
+        return;
+    }
+    deflateEnd(&z->zs);
+    free(z);
+}
+
+unsh_chunk *zout_compress(unsh_zout *z, const unsh_chunk *chunk) {
+    // skipped output never enters the stream, so both ends keep the same window
+    if (chunk->len < UNSH_COMPRESS_MIN || z->bypass) {
+        if (z->bypass) {
+            z->bypass--;
+        }
+        z->bypassed += chunk->len;
+        stats.compress_bypassed += chunk->len;
+        return NULL;
+    }
+
+    unsigned long long start = cpu_now();
+    // a sync flush takes a few bytes on top of the bound
+    size_t cap = deflateBound(&z->zs, chunk->len) + 16;
+    unsh_chunk *ret = chunk_new(UNSH_FRAME_HDRLEN + cap);
+    z->zs.next_in = (Bytef *)chunk->data;
+    z->zs.avail_in = chunk->len;
+    z->zs.next_out = (Bytef *)ret->data + UNSH_FRAME_HDRLEN;
+    z->zs.avail_out = cap;
+    // everything given is flushed out, each frame can be inflated on its own arrival
+    while (deflate(&z->zs, Z_SYNC_FLUSH) == Z_OK && !z->zs.avail_out) {
+        size_t len = cap;
+        cap *= 2;
+        ret = realloc(ret, sizeof(unsh_chunk) + UNSH_FRAME_HDRLEN + cap);
+        z->zs.next_out = (Bytef *)ret->data + UNSH_FRAME_HDRLEN + len;
+        z->zs.avail_out = cap - len;
+    }
+    size_t len = cap - z->zs.avail_out;
+    unsh_frame_pack((unsigned char *)ret->data, UNSH_FRAME_ZDATA, len);
+    ret->len = UNSH_FRAME_HDRLEN + len;
+
+    // the output is sent anyway, the stream already went past it
+    if (len * 100 > chunk->len * UNSH_COMPRESS_KEEP) {
+        z->bypass = UNSH_COMPRESS_SKIP;
+    }
+    unsigned long long ns = cpu_now() - start;
+    z->in += chunk->len;
+    z->out += len;
+    z->cpu_ns += ns;
+    stats.compress_in += chunk->len;
+    stats.compress_out += len;
+    stats.compress_ns += ns;
+    return ret;
+}
+
+size_t zout_format(unsh_zout *z, char *buf, size_t size) {
+    int len = snprintf(buf, size,
+        "session.compress.in %llu\n"
+        "session.compress.out %llu\n"
+        "session.compress.ratio %.2f\n"
+        "session.compress.bypassed %llu\n"
+        "session.compress.cpu_us %llu\n",
+        z->in,
+        z->out,
+        z->out ? (double)z->in / z->out : 0.0,
+        z->bypassed,
+        z->cpu_ns / 1000);
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
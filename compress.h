@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "chunk.h"
+
+// per-client deflate stream for UNSH_FRAME_ZDATA output, set up by the "compress" builtin
+typedef struct unsh_zout unsh_zout;
+
+unsh_zout *zout_new(void);
+void zout_free(unsh_zout *z);
+// a chunk holding the ZDATA frame for chunk, or NULL if it is better sent as it is
+unsh_chunk *zout_compress(unsh_zout *z, const unsh_chunk *chunk);
+// session totals for the "stats" builtin
+size_t zout_format(unsh_zout *z, char *buf, size_t size);
@@ -1,7 +1,57 @@
 #pragma once
 
 #define UNSH_PORT 25252
+// events taken per epoll_wait: unshd starts at the minimum and doubles it while batches come back full
 #define UNSH_MAXEVENTS 1024
+#define UNSH_MINEVENTS 16
 #define UNSH_BUFSIZE 4096
 // minus 1 since UNSH_LINE_MAX does not take into account the null byte
 #define UNSH_LINE_MAX 4095
+// output queued for a client before its pipeline is paused or, if shared, resynced
+#define UNSH_OUTQ_MAX (256 * 1024)
+// paused pipelines resume once the queue drains below this
+#define UNSH_OUTQ_LOW (64 * 1024)
+// initial capacity of the pipes of a pipeline, see F_SETPIPE_SZ in fcntl(2)
+#define UNSH_PIPE_SIZE 65536
+// head and tail pipes that keep filling up are grown up to this
+#define UNSH_PIPE_SIZE_MAX (1024 * 1024)
+// hosts contacted at the same time by "unsh -c", see -p
+#define UNSH_FANOUT_WINDOW 64
+// idle connections kept per host by libunsh
+#define UNSH_POOL_MAX 8
+// events kept per thread by the trace ring buffer, must be a power of 2
+#define UNSH_TRACE_RING 65536
+// trace dump written on SIGUSR2, %d is the pid of unshd
+#define UNSH_TRACE_FILE "/tmp/unshd-%d.trace"
+// spare line buffers kept for reuse, clients only hold one while receiving a command line
+#define UNSH_LINEBUF_POOL 64
+// threads running blocking filesystem work, such as opening redirections
+#define UNSH_HELPER_THREADS 4
+// listening sockets taken from a supervisor or handed over on restart
+#define UNSH_LISTEN_MAX 16
+// deflate level of compressed sessions, see the "compress" builtin
+#define UNSH_COMPRESS_LEVEL 1
+// output smaller than this goes out uncompressed, the frame would not pay off
+#define UNSH_COMPRESS_MIN 128
+// output compressed to more than this percentage of its size counts as incompressible
+#define UNSH_COMPRESS_KEEP 90
+// chunks sent uncompressed after incompressible output, before trying again
+#define UNSH_COMPRESS_SKIP 32
+// largest DATA frame sent by "get", other output of the client goes out between frames
+#define UNSH_XFER_FRAME (1024 * 1024)
+// file contents queued by "unsh -P" before waiting for the socket to take them
+#define UNSH_XFER_WINDOW (256 * 1024)
+// limits of the cgroup of each pipeline, changed per session with the "limit" builtin
+#define UNSH_CGROUP_CPU_WEIGHT "100"
+#define UNSH_CGROUP_MEMORY_MAX "max"
+#define UNSH_CGROUP_PIDS_MAX "max"
+// "priority batch" sessions: nice value and best-effort I/O level of their pipelines
+#define UNSH_BATCH_NICE 10
+#define UNSH_BATCH_IOPRIO 7
+// percentage of the session's cpu.weight given to the cgroups of batch pipelines
+#define UNSH_BATCH_CPU_SHARE 10
+// pipeline output relayed per wakeup before other sockets get their turn
+#define UNSH_RELAY_BUDGET (256 * 1024)
+#define UNSH_BATCH_RELAY_BUDGET (32 * 1024)
+// session records are written out once per event loop round, or when this fills up
+#define UNSH_RECORD_BUFSIZE (64 * 1024)
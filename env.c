@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "env.h"
+
+char **env_vars(unsh_env *env) {
+    return env->vars ? env->vars : environ;
+}
+
+static char **env_find(unsh_env *env, const char *name) {
+    size_t len = strlen(name);
+    for (char **var = env_vars(env); *var; var++) {
+        if (!strncmp(*var, name, len) && (*var)[len] == '=') {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+const char *env_get(unsh_env *env, const char *name) {
+    char **var = env_find(env, name);
+    return var ? *var + strlen(name) + 1 : NULL;
+}
+
+// copy on write
+static void env_own(unsh_env *env) {
+    if (env->vars) {
+        return;
+    }
+    for (env->count = 0; environ[env->count]; env->count++);
+    env->vars = malloc((env->count + 1) * sizeof(char *));
+    for (size_t i = 0; i < env->count; i++) {
+        env->vars[i] = strdup(environ[i]);
+    }
+    env->vars[env->count] = NULL;
+}
+
+void env_set(unsh_env *env, const char *name, const char *value) {
+    env_own(env);
+    char *entry;
+    if (asprintf(&entry, "%s=%s", name, value) < 0) {
+        return;
+    }
+    char **var = env_find(env, name);
+    if (var) {
+        free(*var);
+        *var = entry;
+        return;
+    }
+    env->vars = realloc(env->vars, (env->count + 2) * sizeof(char *));
+    env->vars[env->count++] = entry;
+    env->vars[env->count] = NULL;
+}
+
+void env_unset(unsh_env *env, const char *name) {
+    if (!env_find(env, name)) {
+        return;
+    }
+    env_own(env);
+    char **var = env_find(env, name);
+    free(*var);
+    *var = env->vars[--env->count];
+    env->vars[env->count] = NULL;
+}
+
+void env_clear(unsh_env *env) {
+    if (env->vars) {
+        for (size_t i = 0; i < env->count; i++) {
+            free(env->vars[i]);
+        }
+        free(env->vars);
+    }
+    env->vars = NULL;
+    env->count = 0;
+}
+
+bool env_valid_name(const char *name, size_t len) {
+    if (!len || isdigit((unsigned char)name[0])) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] != '_' && !isalnum((unsigned char)name[i])) {
+            return false;
+        }
+    }
+    return true;
+}
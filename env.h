@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// per-session environment, a copy of the daemon's made on the first change
+typedef struct unsh_env {
+    // null-terminated "NAME=value" strings, NULL while still the daemon's
+    char **vars;
+    size_t count;
+} unsh_env;
+
+// for execve() and the parser
+char **env_vars(unsh_env *env);
+const char *env_get(unsh_env *env, const char *name);
+void env_set(unsh_env *env, const char *name, const char *value);
+void env_unset(unsh_env *env, const char *name);
+void env_clear(unsh_env *env);
+// shell variable names: letters, digits and underscores, not starting with a digit
+bool env_valid_name(const char *name, size_t len);
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "handoff.h"
+
+// systemd passes its sockets starting from this fd
+#define LISTEN_FDS_START 3
+// the channel to the previous unshd, set in the environment of its replacement
+#define HANDOFF_ENV "UNSH_HANDOFF_FD"
+
+static int chanfd = -1;
+
+static int listener_setup(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "inherited fd %d is not a socket\n", fd);
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        perror("cannot set listener state");
+        return -1;
+    }
+    return 0;
+}
+
+static int env_int(const char *name) {
+    const char *value = getenv(name);
+    if (!value) {
+        return -1;
+    }
+    char *end;
+    long ret = strtol(value, &end, 10);
+    return *value && !*end && ret >= 0 ? (int)ret : -1;
+}
+
+static int activation_fds(int *fds, int max) {
+    int nfds = env_int("LISTEN_FDS");
+    // meant for us only, not for the jobs or a process we exec
+    int pid = env_int("LISTEN_PID");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (nfds <= 0 || pid != getpid()) {
+        return 0;
+    }
+    if (nfds > max) {
+        fprintf(stderr, "too many listening sockets passed, keeping %d\n", max);
+        for (int i = max; i < nfds; i++) {
+            close(LISTEN_FDS_START + i);
+        }
+        nfds = max;
+    }
+    for (int i = 0; i < nfds; i++) {
+        fds[i] = LISTEN_FDS_START + i;
+        if (listener_setup(fds[i]) < 0) {
+            return -1;
+        }
+    }
+    return nfds;
+}
+
+static int handoff_recv(int *fds, int max) {
+    int nfds;
+    struct iovec iov = {&nfds, sizeof(nfds)};
+    union {
+        char buf[CMSG_SPACE(UNSH_LISTEN_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t thisread;
+    while ((thisread = recvmsg(chanfd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (thisread != sizeof(nfds)) {
+        perror("cannot receive listeners");
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || nfds <= 0 || nfds > max
+            || cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int))) {
+        fprintf(stderr, "bad listener handoff\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    for (int i = 0; i < nfds; i++) {
+        if (listener_setup(fds[i]) < 0) {
+            return -1;
+        }
+    }
+    return nfds;
+}
+
+int handoff_listen_fds(int *fds, int max) {
+    chanfd = env_int(HANDOFF_ENV);
+    unsetenv(HANDOFF_ENV);
+    if (chanfd < 0) {
+        return activation_fds(fds, max);
+    }
+    if (fcntl(chanfd, F_SETFD, FD_CLOEXEC) < 0) {
+        perror("cannot set handoff channel state");
+        return -1;
+    }
+    return handoff_recv(fds, max);
+}
+
+void handoff_ready(void) {
+    if (chanfd < 0) {
+        return;
+    }
+    if (write(chanfd, "", 1) != 1) {
+        perror("cannot acknowledge handoff");
+    }
+    close(chanfd);
+    chanfd = -1;
+}
+
+int handoff_start(char **argv, const int *fds, int nfds) {
+    int chan[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, chan) < 0) {
+        perror("cannot create handoff channel");
+        return -1;
+    }
+
+    // set up before forking, the helper threads make the child unfit for malloc()
+    char value[16];
+    snprintf(value, sizeof(value), "%d", chan[1]);
+    if (setenv(HANDOFF_ENV, value, 1) < 0) {
+        perror("cannot pass handoff channel");
+        close(chan[0]);
+        close(chan[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (!pid) {
+        // only the channel survives the exec, the listeners come through it
+        if (fcntl(chan[1], F_SETFD, 0) < 0) {
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        perror("cannot exec new unshd");
+        _exit(127);
+    }
+    unsetenv(HANDOFF_ENV);
+    if (pid < 0) {
+        perror("cannot fork new unshd");
+        close(chan[0]);
+        close(chan[1]);
+        return -1;
+    }
+    close(chan[1]);
+
+    struct iovec iov = {&nfds, sizeof(nfds)};
+    union {
+        char buf[CMSG_SPACE(UNSH_LISTEN_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    // the channel is empty, this cannot block
+    if (sendmsg(chan[0], &msg, MSG_NOSIGNAL) != sizeof(nfds)) {
+        perror("cannot send listeners");
+        close(chan[0]);
+        return -1;
+    }
+    return chan[0];
+}
+
+int handoff_finish(int fd) {
+    char ack;
+    ssize_t thisread;
+    while ((thisread = read(fd, &ack, 1)) < 0 && errno == EINTR);
+    close(fd);
+    return thisread == 1 ? 0 : -1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// listening sockets that outlive a single unshd process
+// they come from a supervisor (LISTEN_FDS, see sd_listen_fds(3)), or from the previous
+// unshd on a graceful restart; either way no connection is refused meanwhile
+
+// fills fds with inherited listeners, returns their count, 0 if we have to bind ourselves
+int handoff_listen_fds(int *fds, int max);
+// tell the previous unshd that we are serving, after the listeners are registered
+void handoff_ready(void);
+// start a new unshd from argv and send it the listeners
+// returns our end of the channel, readable once the new process is serving or has failed
+int handoff_start(char **argv, const int *fds, int nfds);
+// consume the answer on the channel, returns 0 if the new process took over
+int handoff_finish(int chanfd);
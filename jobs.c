@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "cgroup.h"
+#include "jobs.h"
+
+static unsh_job *alljobs = NULL;
+
+unsh_job *job_new(unsh_socket *clientsock, bool background, char *cmdline) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    unsh_job *ret = calloc(1, sizeof(unsh_job));
+    // job numbers start over once the table is empty, like in a shell
+    if (!client->jobs) {
+        client->nextjobid = 1;
+    }
+    ret->id = client->nextjobid++;
+    ret->clientsock = clientsock;
+    ret->posock = NULL;
+    ret->background = background;
+    ret->cmdline = cmdline;
+    ret->cgfd = -1;
+
+    // keep the table ordered by job number
+    unsh_job **link = &client->jobs;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = ret;
+
+    ret->nextall = alljobs;
+    alljobs = ret;
+    return ret;
+}
+
+void job_addpid(unsh_job *job, pid_t pid) {
+    job->pids = realloc(job->pids, (job->npids + 1) * sizeof(pid_t));
+    job->pids[job->npids++] = pid;
+    job->nlive++;
+    if (!job->pgid) {
+        job->pgid = pid;
+    }
+}
+
+// record the exit of a child, returns the job it belonged to
+unsh_job *job_reap(pid_t pid, int status) {
+    for (unsh_job *job = alljobs; job; job = job->nextall) {
+        for (size_t i = 0; i < job->npids; i++) {
+            if (job->pids[i] == pid) {
+                job->pids[i] = 0;
+                job->nlive--;
+                if (i == job->npids - 1) {
+                    job->status = status;
+                }
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+unsh_job *job_find(unsh_socket *clientsock, int id) {
+    for (unsh_job *job = clientsock->sockaff.client.jobs; job; job = job->next) {
+        if (job->id == id) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// remove a job from its client's table, it stays known for reaping
+void job_detach(unsh_job *job) {
+    if (!job->clientsock) {
+        return;
+    }
+    unsh_job **link = &job->clientsock->sockaff.client.jobs;
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    job->next = NULL;
+    job->clientsock = NULL;
+}
+
+void job_free(unsh_job *job) {
+    job_detach(job);
+    unsh_job **link = &alljobs;
+    while (*link != job) {
+        link = &(*link)->nextall;
+    }
+    *link = job->nextall;
+    if (job->cgfd >= 0) {
+        cgroup_release(job->cgfd, job->cgid);
+    }
+    free(job->pids);
+    free(job->cmdline);
+    free(job);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "sockdata.h"
+
+typedef struct unsh_job {
+    // link in the owning client's job table
+    unsh_job *next;
+    // link in the daemon-wide list used to match reaped children
+    unsh_job *nextall;
+    int id;
+    // NULL once the client has gone away and the job only feeds watchers
+    unsh_socket *clientsock;
+    // tail pipe of the pipeline, NULL once its output is done
+    unsh_socket *posock;
+    pid_t pgid;
+    pid_t *pids;
+    size_t npids;
+    size_t nlive;
+    // wait status of the last stage
+    int status;
+    bool background;
+    // started by a "priority batch" session
+    bool batch;
+    // cgroup of the pipeline, -1 if it runs in unshd's
+    int cgfd;
+    unsigned long cgid;
+    char *cmdline;
+} unsh_job;
+
+unsh_job *job_new(unsh_socket *clientsock, bool background, char *cmdline);
+void job_addpid(unsh_job *job, pid_t pid);
+unsh_job *job_reap(pid_t pid, int status);
+unsh_job *job_find(unsh_socket *clientsock, int id);
+void job_detach(unsh_job *job);
+void job_free(unsh_job *job);
@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "libunsh.h"
+#include "protocol.h"
+
+typedef struct unsh_pool unsh_pool;
+
+typedef enum unsh_connstate {
+    CONNSTATE_CONNECTING,
+    // connected, waiting for the server to acknowledge framed mode, and compression if asked
+    CONNSTATE_HANDSHAKE,
+    CONNSTATE_READY
+} unsh_connstate;
+
+typedef struct unsh_conn {
+    // idle list of the pool, while there is no command
+    struct unsh_conn *next;
+    // all connections of the client
+    struct unsh_conn *nextall;
+    unsh_pool *pool;
+    int fd;
+    // closed, freed after the current batch of events
+    bool dead;
+    struct unsh_conn *nextdead;
+    unsh_connstate state;
+    // handshake commands not answered yet
+    int handshakes;
+    uint32_t events;
+    unsh_cmd *cmd;
+    // the connection was idle before the command, the server may have dropped it since
+    bool reused;
+    // something was received for the command
+    bool answered;
+    // frame being received
+    unsigned char hdr[UNSH_FRAME_HDRLEN];
+    size_t hdrlen;
+    uint32_t left;
+    unsigned char status[4];
+    // output stream of ZDATA frames, if compression was asked for
+    z_stream *zin;
+    // bytes not yet taken by the socket
+    char *out;
+    size_t outlen;
+    size_t outcap;
+} unsh_conn;
+
+// connections to one host
+struct unsh_pool {
+    unsh_pool *next;
+    char *name;
+    struct sockaddr_in sa;
+    unsh_conn *idle;
+    size_t nidle;
+};
+
+struct unsh_cmd {
+    unsh_client *cl;
+    unsh_pool *pool;
+    unsh_conn *conn;
+    char *command;
+    unsh_output_cb out_cb;
+    unsh_done_cb done_cb;
+    void *arg;
+    bool wroteinput;
+    bool inputclosed;
+    bool retried;
+    // may leave jobs or session state on the connection, which is then not reused
+    bool dirty;
+};
+
+struct unsh_client {
+    int epollfd;
+    unsh_pool *pools;
+    unsh_conn *conns;
+    unsh_conn *deadconns;
+    size_t pending;
+    bool compress;
+    // connections are reused whatever their commands leave behind
+    bool session;
+    char buf[UNSH_BUFSIZE];
+    char zbuf[UNSH_BUFSIZE];
+};
+
+static const char handshake[] = "framed\n";
+static const char compress_cmd[] = "compress";
+// builtins that change the session for the commands after them
+static const char *const session_builtins[] = {"export", "unset", "limit", "priority", "compress", "framed", "share"};
+
+unsh_client *unsh_client_new(void) {
+    unsh_client *cl = malloc(sizeof(unsh_client));
+    if (!cl) {
+        return NULL;
+    }
+    memset(cl, 0, sizeof(unsh_client));
+    cl->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (cl->epollfd < 0) {
+        free(cl);
+        return NULL;
+    }
+    return cl;
+}
+
+// close a connection, its memory stays around until reapconns
+static void conn_retire(unsh_client *cl, unsh_conn *conn) {
+    if (conn->dead) {
+        return;
+    }
+    for (unsh_conn **link = &cl->conns; *link; link = &(*link)->nextall) {
+        if (*link == conn) {
+            *link = conn->nextall;
+            break;
+        }
+    }
+    if (!conn->cmd) {
+        unsh_pool *pool = conn->pool;
+        for (unsh_conn **link = &pool->idle; *link; link = &(*link)->next) {
+            if (*link == conn) {
+                *link = conn->next;
+                pool->nidle--;
+                break;
+            }
+        }
+    }
+    close(conn->fd);
+    conn->dead = true;
+    conn->nextdead = cl->deadconns;
+    cl->deadconns = conn;
+}
+
+static void reapconns(unsh_client *cl) {
+    while (cl->deadconns) {
+        unsh_conn *conn = cl->deadconns;
+        cl->deadconns = conn->nextdead;
+        if (conn->zin) {
+            inflateEnd(conn->zin);
+            free(conn->zin);
+        }
+        free(conn->out);
+        free(conn);
+    }
+}
+
+static void cmd_free(unsh_cmd *cmd) {
+    free(cmd->command);
+    free(cmd);
+}
+
+void unsh_client_free(unsh_client *cl) {
+    while (cl->conns) {
+        unsh_conn *conn = cl->conns;
+        if (conn->cmd) {
+            cmd_free(conn->cmd);
+            conn->cmd = NULL;
+        }
+        conn_retire(cl, conn);
+    }
+    reapconns(cl);
+    while (cl->pools) {
+        unsh_pool *pool = cl->pools;
+        cl->pools = pool->next;
+        free(pool->name);
+        free(pool);
+    }
+    close(cl->epollfd);
+    free(cl);
+}
+
+void unsh_client_set_compress(unsh_client *cl, bool on) {
+    cl->compress = on;
+}
+
+void unsh_client_set_session(unsh_client *cl, bool on) {
+    cl->session = on;
+}
+
+int unsh_client_fd(unsh_client *cl) {
+    return cl->epollfd;
+}
+
+size_t unsh_client_pending(unsh_client *cl) {
+    return cl->pending;
+}
+
+const char *unsh_cmd_host(unsh_cmd *cmd) {
+    return cmd->pool->name;
+}
+
+// look up or create the pool of a host, resolving its address only the first time
+static unsh_pool *pool_get(unsh_client *cl, const char *host) {
+    for (unsh_pool *pool = cl->pools; pool; pool = pool->next) {
+        if (!strcmp(pool->name, host)) {
+            return pool;
+        }
+    }
+
+    char *name = strdup(host);
+    int port = UNSH_PORT;
+    char *colon = strrchr(name, ':');
+    if (colon) {
+        *colon = 0;
+        port = atoi(colon + 1);
+    }
+    struct hostent *he = gethostbyname(name);
+    free(name);
+    if (!he) {
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+
+    unsh_pool *pool = malloc(sizeof(unsh_pool));
+    memset(pool, 0, sizeof(unsh_pool));
+    pool->name = strdup(host);
+    pool->sa.sin_family = AF_INET;
+    memcpy((char *)&pool->sa.sin_addr.s_addr, he->h_addr_list[0], he->h_length);
+    pool->sa.sin_port = htons(port);
+    pool->next = cl->pools;
+    cl->pools = pool;
+    return pool;
+}
+
+static int conn_update_events(unsh_client *cl, unsh_conn *conn) {
+    uint32_t events = conn->state == CONNSTATE_CONNECTING ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    if (conn->outlen) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return 0;
+    }
+    struct epoll_event connopts = {0};
+    connopts.events = events;
+    connopts.data.ptr = conn;
+    if (epoll_ctl(cl->epollfd, EPOLL_CTL_MOD, conn->fd, &connopts) < 0) {
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+// queue bytes for the server, they go out once the socket is writable
+static void conn_queue(unsh_conn *conn, const void *data, size_t len) {
+    if (conn->outlen + len > conn->outcap) {
+        conn->outcap = (conn->outlen + len) * 2;
+        conn->out = realloc(conn->out, conn->outcap);
+    }
+    memcpy(conn->out + conn->outlen, data, len);
+    conn->outlen += len;
+}
+
+static void conn_queue_frame(unsh_conn *conn, unsh_frametype type, const void *data, size_t len) {
+    unsigned char hdr[UNSH_FRAME_HDRLEN];
+    unsh_frame_pack(hdr, type, len);
+    conn_queue(conn, hdr, UNSH_FRAME_HDRLEN);
+    if (len) {
+        conn_queue(conn, data, len);
+    }
+}
+
+static unsh_conn *conn_open(unsh_client *cl, unsh_pool *pool) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&pool->sa, sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    unsh_conn *conn = malloc(sizeof(unsh_conn));
+    memset(conn, 0, sizeof(unsh_conn));
+    conn->pool = pool;
+    conn->fd = fd;
+    conn->state = CONNSTATE_CONNECTING;
+    conn->events = EPOLLOUT;
+    // the server is told to switch to framed mode with a plain command line
+    conn_queue(conn, handshake, sizeof(handshake) - 1);
+    conn->handshakes = 1;
+    if (cl->compress) {
+        conn->zin = calloc(1, sizeof(z_stream));
+        if (conn->zin && inflateInit2(conn->zin, -15) == Z_OK) {
+            conn_queue_frame(conn, UNSH_FRAME_CMD, compress_cmd, sizeof(compress_cmd) - 1);
+            conn->handshakes++;
+        } else {
+            free(conn->zin);
+            conn->zin = NULL;
+        }
+    }
+
+    struct epoll_event connopts = {0};
+    connopts.events = conn->events;
+    connopts.data.ptr = conn;
+    if (epoll_ctl(cl->epollfd, EPOLL_CTL_ADD, fd, &connopts) < 0) {
+        close(fd);
+        free(conn->out);
+        free(conn);
+        return NULL;
+    }
+    conn->nextall = cl->conns;
+    cl->conns = conn;
+    return conn;
+}
+
+// return a connection without command to the pool, or drop it if the pool is full
+static void conn_release(unsh_client *cl, unsh_conn *conn) {
+    unsh_pool *pool = conn->pool;
+    conn->cmd = NULL;
+    if (pool->nidle >= UNSH_POOL_MAX) {
+        conn_retire(cl, conn);
+        return;
+    }
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pool->nidle++;
+}
+
+// errs on the safe side, a quoted & only costs a new connection
+static bool cmd_leaves_state(const char *command) {
+    if (strchr(command, '&')) {
+        return true;
+    }
+    command += strspn(command, " \t");
+    size_t len = strcspn(command, " \t");
+    for (size_t i = 0; i < sizeof(session_builtins) / sizeof(session_builtins[0]); i++) {
+        if (strlen(session_builtins[i]) == len && !strncmp(command, session_builtins[i], len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int cmd_attach(unsh_client *cl, unsh_cmd *cmd) {
+    unsh_pool *pool = cmd->pool;
+    unsh_conn *conn = pool->idle;
+    if (conn) {
+        pool->idle = conn->next;
+        pool->nidle--;
+        conn->reused = conn->state == CONNSTATE_READY;
+    } else {
+        conn = conn_open(cl, pool);
+        if (!conn) {
+            return -1;
+        }
+        conn->reused = false;
+    }
+    conn->cmd = cmd;
+    conn->answered = false;
+    cmd->conn = conn;
+    conn_queue_frame(conn, UNSH_FRAME_CMD, cmd->command, strlen(cmd->command));
+    if (cmd->inputclosed) {
+        conn_queue_frame(conn, UNSH_FRAME_EOF, NULL, 0);
+    }
+    return conn_update_events(cl, conn);
+}
+
+static void cmd_done(unsh_client *cl, unsh_cmd *cmd, int status, int error) {
+    cl->pending--;
+    cmd->done_cb(cmd, status, error, cmd->arg);
+    cmd_free(cmd);
+}
+
+// the connection is unusable, its command is retried if that is safe or else fails
+static void conn_fail(unsh_client *cl, unsh_conn *conn, int error) {
+    unsh_cmd *cmd = conn->cmd;
+    bool retry = cmd && conn->reused && !conn->answered && !cmd->wroteinput && !cmd->retried;
+    conn->cmd = NULL;
+    conn_retire(cl, conn);
+    if (!cmd) {
+        return;
+    }
+    cmd->conn = NULL;
+    if (retry) {
+        // most likely an idle connection closed by the server, try once on a fresh one
+        cmd->retried = true;
+        if (cmd_attach(cl, cmd) == 0) {
+            return;
+        }
+        error = errno;
+        if (cmd->conn) {
+            cmd->conn->cmd = NULL;
+            conn_retire(cl, cmd->conn);
+        }
+    }
+    cmd_done(cl, cmd, -1, error);
+}
+
+static int conn_flush(unsh_conn *conn) {
+    while (conn->outlen) {
+        ssize_t thiswrite = write(conn->fd, conn->out, conn->outlen);
+        if (thiswrite < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->outlen -= thiswrite;
+        memmove(conn->out, conn->out + thiswrite, conn->outlen);
+    }
+    return 0;
+}
+
+// a whole frame header or DONE payload was received, returns false on protocol error
+static bool conn_frame_end(unsh_client *cl, unsh_conn *conn) {
+    if (conn->hdr[0] != UNSH_FRAME_DONE) {
+        conn->hdrlen = 0;
+        return true;
+    }
+    conn->hdrlen = 0;
+    int status = (int)((uint32_t)conn->status[0] << 24 | (uint32_t)conn->status[1] << 16 | (uint32_t)conn->status[2] << 8 | conn->status[3]);
+    if (conn->state == CONNSTATE_HANDSHAKE) {
+        // a server without compression fails the command, and then only sends DATA frames
+        if (--conn->handshakes == 0) {
+            conn->state = CONNSTATE_READY;
+        }
+        return true;
+    }
+    unsh_cmd *cmd = conn->cmd;
+    if (!cmd) {
+        return false;
+    }
+    if (cmd->dirty && !cl->session) {
+        // its jobs would write into the output of whatever command comes next
+        conn->cmd = NULL;
+        conn_retire(cl, conn);
+    } else {
+        conn_release(cl, conn);
+    }
+    cmd_done(cl, cmd, status, 0);
+    return true;
+}
+
+// the stream is inflated even without a command, to stay in step with the server
+static bool conn_inflate(unsh_client *cl, unsh_conn *conn, const char *data, size_t len) {
+    z_stream *zs = conn->zin;
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = len;
+    do {
+        zs->next_out = (Bytef *)cl->zbuf;
+        zs->avail_out = UNSH_BUFSIZE;
+        int ret = inflate(zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return false;
+        }
+        size_t have = UNSH_BUFSIZE - zs->avail_out;
+        if (have && conn->cmd && conn->state == CONNSTATE_READY) {
+            conn->cmd->out_cb(conn->cmd, cl->zbuf, have, conn->cmd->arg);
+            if (conn->dead) {
+                return true;
+            }
+        }
+    } while (zs->avail_in || !zs->avail_out);
+    return true;
+}
+
+// parse what the server sent, returns false on protocol error
+static bool conn_parse(unsh_client *cl, unsh_conn *conn, const char *data, size_t len) {
+    if (conn->cmd && len) {
+        conn->answered = true;
+    }
+    while (len) {
+        if (conn->hdrlen < UNSH_FRAME_HDRLEN) {
+            size_t n = UNSH_FRAME_HDRLEN - conn->hdrlen < len ? UNSH_FRAME_HDRLEN - conn->hdrlen : len;
+            memcpy(conn->hdr + conn->hdrlen, data, n);
+            conn->hdrlen += n;
+            data += n;
+            len -= n;
+            if (conn->hdrlen < UNSH_FRAME_HDRLEN) {
+                break;
+            }
+            conn->left = unsh_frame_len(conn->hdr);
+            if (conn->hdr[0] == UNSH_FRAME_DONE ? conn->left != 4 : conn->hdr[0] != UNSH_FRAME_DATA && (conn->hdr[0] != UNSH_FRAME_ZDATA || !conn->zin)) {
+                return false;
+            }
+            if (!conn->left && !conn_frame_end(cl, conn)) {
+                return false;
+            }
+            if (conn->dead) {
+                return true;
+            }
+            continue;
+        }
+
+        size_t n = conn->left < len ? conn->left : len;
+        if (conn->hdr[0] == UNSH_FRAME_DONE) {
+            memcpy(conn->status + 4 - conn->left, data, n);
+        } else if (conn->hdr[0] == UNSH_FRAME_ZDATA) {
+            if (!conn_inflate(cl, conn, data, n)) {
+                return false;
+            }
+            if (conn->dead) {
+                return true;
+            }
+        } else if (conn->cmd && conn->state == CONNSTATE_READY) {
+            // output arriving between commands, e.g. background job notices, is dropped
+            conn->cmd->out_cb(conn->cmd, data, n, conn->cmd->arg);
+            if (conn->dead) {
+                return true;
+            }
+        }
+        data += n;
+        len -= n;
+        conn->left -= n;
+        if (!conn->left && !conn_frame_end(cl, conn)) {
+            return false;
+        }
+        if (conn->dead) {
+            return true;
+        }
+    }
+    return true;
+}
+
+static void conn_handle(unsh_client *cl, unsh_conn *conn, uint32_t evcode) {
+    if (conn->dead) {
+        return;
+    }
+    if (evcode & EPOLLERR) {
+        int sockerr = 0;
+        socklen_t sockerrsize = sizeof(int);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &sockerr, &sockerrsize);
+        conn_fail(cl, conn, sockerr ? sockerr : ECONNRESET);
+        return;
+    }
+
+    if (evcode & EPOLLOUT) {
+        if (conn->state == CONNSTATE_CONNECTING) {
+            conn->state = CONNSTATE_HANDSHAKE;
+        }
+        if (conn_flush(conn) < 0) {
+            conn_fail(cl, conn, errno);
+            return;
+        }
+    }
+
+    if (evcode & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        ssize_t thisread;
+        while ((thisread = read(conn->fd, cl->buf, UNSH_BUFSIZE)) > 0) {
+            // the connection may go back to the pool, and be picked up again, from a callback
+            if (!conn_parse(cl, conn, cl->buf, thisread)) {
+                conn_fail(cl, conn, EPROTO);
+                return;
+            }
+            if (conn->dead) {
+                return;
+            }
+        }
+        if (thisread == 0) {
+            conn_fail(cl, conn, ECONNRESET);
+            return;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_fail(cl, conn, errno);
+            return;
+        }
+    }
+
+    if (conn_update_events(cl, conn) < 0) {
+        conn_fail(cl, conn, errno);
+    }
+}
+
+int unsh_client_process(unsh_client *cl, int timeout_ms) {
+    struct epoll_event events[64];
+    int pending = epoll_wait(cl->epollfd, events, 64, timeout_ms);
+    if (pending < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < pending; i++) {
+        conn_handle(cl, events[i].data.ptr, events[i].events);
+    }
+    reapconns(cl);
+    return pending;
+}
+
+int unsh_connect(unsh_client *cl, const char *host) {
+    unsh_pool *pool = pool_get(cl, host);
+    if (!pool) {
+        return -1;
+    }
+    unsh_conn *conn = conn_open(cl, pool);
+    if (!conn) {
+        return -1;
+    }
+    conn_release(cl, conn);
+    return 0;
+}
+
+unsh_cmd *unsh_submit(unsh_client *cl, const char *host, const char *command, unsh_output_cb out_cb, unsh_done_cb done_cb, void *arg) {
+    if (strlen(command) > UNSH_LINE_MAX) {
+        errno = E2BIG;
+        return NULL;
+    }
+    unsh_pool *pool = pool_get(cl, host);
+    if (!pool) {
+        return NULL;
+    }
+
+    unsh_cmd *cmd = malloc(sizeof(unsh_cmd));
+    memset(cmd, 0, sizeof(unsh_cmd));
+    cmd->cl = cl;
+    cmd->pool = pool;
+    cmd->command = strdup(command);
+    cmd->dirty = cmd_leaves_state(command);
+    cmd->out_cb = out_cb;
+    cmd->done_cb = done_cb;
+    cmd->arg = arg;
+    if (cmd_attach(cl, cmd) < 0) {
+        int error = errno;
+        if (cmd->conn) {
+            cmd->conn->cmd = NULL;
+            conn_retire(cl, cmd->conn);
+        }
+        cmd_free(cmd);
+        errno = error;
+        return NULL;
+    }
+    cl->pending++;
+    return cmd;
+}
+
+int unsh_cmd_write(unsh_cmd *cmd, const void *data, size_t len) {
+    if (cmd->inputclosed) {
+        errno = EPIPE;
+        return -1;
+    }
+    cmd->wroteinput = true;
+    conn_queue_frame(cmd->conn, UNSH_FRAME_DATA, data, len);
+    return conn_update_events(cmd->cl, cmd->conn);
+}
+
+size_t unsh_cmd_queued(unsh_cmd *cmd) {
+    return cmd->conn ? cmd->conn->outlen : 0;
+}
+
+int unsh_cmd_close_input(unsh_cmd *cmd) {
+    if (cmd->inputclosed) {
+        return 0;
+    }
+    cmd->inputclosed = true;
+    conn_queue_frame(cmd->conn, UNSH_FRAME_EOF, NULL, 0);
+    return conn_update_events(cmd->cl, cmd->conn);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// asynchronous unshd client
+// commands run over framed connections, which are kept open and reused per host
+// a connection is not reused after a command that may leave background jobs or session state
+// behind ("&", export, unset, limit, priority, compress, share), unless the client is a session
+// nothing blocks but the host name lookup, done the first time a host is used
+// call unsh_client_process whenever unsh_client_fd is readable
+
+typedef struct unsh_client unsh_client;
+typedef struct unsh_cmd unsh_cmd;
+
+// output of a command, in the order the server sent it
+typedef void (*unsh_output_cb)(unsh_cmd *cmd, const char *data, size_t len, void *arg);
+// the command is over, with its exit status, or with an errno value if it was lost
+// the command is freed once this returns
+typedef void (*unsh_done_cb)(unsh_cmd *cmd, int status, int error, void *arg);
+
+unsh_client *unsh_client_new(void);
+// drops connections and outstanding commands, without calling their callbacks
+void unsh_client_free(unsh_client *cl);
+// ask for compressed output on connections opened from now on, servers without it send plain output
+void unsh_client_set_compress(unsh_client *cl, bool on);
+// commands share the session of their host's connection, like lines typed in a shell:
+// exports and jobs carry over to the next command, which also gets the output of earlier jobs
+// meant for one command at a time per host
+void unsh_client_set_session(unsh_client *cl, bool on);
+
+// an epoll fd, readable when unsh_client_process has work to do
+int unsh_client_fd(unsh_client *cl);
+// handle connection events, waiting at most timeout_ms for them (-1 forever)
+// callbacks are called from here, returns -1 on error
+int unsh_client_process(unsh_client *cl, int timeout_ms);
+// commands submitted and not done yet
+size_t unsh_client_pending(unsh_client *cl);
+
+// open a connection to host ("name" or "name:port") ahead of time, and keep it idle
+// the host address is resolved once and cached, an unknown host fails with EHOSTUNREACH
+// resolving it blocks, as it does in unsh_submit for a host that was not used before
+int unsh_connect(unsh_client *cl, const char *host);
+// run command on host, on an idle connection if there is one
+// returns NULL with errno set if the command could not be queued
+unsh_cmd *unsh_submit(unsh_client *cl, const char *host, const char *command, unsh_output_cb out_cb, unsh_done_cb done_cb, void *arg);
+// send input to the command, as much as needed is buffered
+int unsh_cmd_write(unsh_cmd *cmd, const void *data, size_t len);
+// bytes written but not taken by the socket yet, to pace big inputs
+size_t unsh_cmd_queued(unsh_cmd *cmd);
+// end of input of the command
+int unsh_cmd_close_input(unsh_cmd *cmd);
+const char *unsh_cmd_host(unsh_cmd *cmd);
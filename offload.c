@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "offload.h"
+#include "trace.h"
+
+// submitted tasks, and tasks whose work is over, both in FIFO order
+static unsh_task *pending_head, *pending_tail;
+static unsh_task *finished_head, *finished_tail;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static int donefd = -1;
+
+static void task_append(unsh_task **head, unsh_task **tail, unsh_task *task) {
+    task->next = NULL;
+    if (*tail) {
+        (*tail)->next = task;
+    } else {
+        *head = task;
+    }
+    *tail = task;
+}
+
+static void *helper_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (!pending_head) {
+            pthread_cond_wait(&wakeup, &lock);
+        }
+        unsh_task *task = pending_head;
+        pending_head = task->next;
+        if (!pending_head) {
+            pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        UNSH_TRACE_BEGIN(TRACE_OFFLOAD, 0);
+        task->work(task);
+        UNSH_TRACE_END(TRACE_OFFLOAD, 0);
+
+        pthread_mutex_lock(&lock);
+        task_append(&finished_head, &finished_tail, task);
+        pthread_mutex_unlock(&lock);
+        if (eventfd_write(donefd, 1) < 0) {
+            perror("cannot signal task completion");
+        }
+    }
+    return NULL;
+}
+
+int offload_init(void) {
+    donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (donefd < 0) {
+        perror("cannot create offload eventfd");
+        return -1;
+    }
+    // signals stay blocked in the helpers, they inherit the mask of the caller
+    for (int i = 0; i < UNSH_HELPER_THREADS; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, helper_main, NULL);
+        if (err) {
+            fprintf(stderr, "cannot start helper thread: %s\n", strerror(err));
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return donefd;
+}
+
+void offload_submit(unsh_task *task) {
+    pthread_mutex_lock(&lock);
+    task_append(&pending_head, &pending_tail, task);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+void offload_complete(int epollfd) {
+    eventfd_t count;
+    if (eventfd_read(donefd, &count) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    unsh_task *task = finished_head;
+    finished_head = finished_tail = NULL;
+    pthread_mutex_unlock(&lock);
+    while (task) {
+        unsh_task *next = task->next;
+        task->done(epollfd, task);
+        task = next;
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// blocking filesystem work run on helper threads, so that a slow mount does not stall the event loop
+// tasks are embedded at the start of the caller's own request struct
+typedef struct unsh_task {
+    struct unsh_task *next;
+    // run on a helper thread, must not touch event loop state
+    void (*work)(struct unsh_task *task);
+    // run on the event loop once work is over, owns the task
+    void (*done)(int epollfd, struct unsh_task *task);
+} unsh_task;
+
+// start the helpers, returns the eventfd to be polled for completions
+int offload_init(void);
+void offload_submit(unsh_task *task);
+// consume the eventfd and call done for every finished task
+void offload_complete(int epollfd);
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pathcache.h"
+#include "stats.h"
+
+#define PATHCACHE_BUCKETS 256
+
+typedef struct pathcache_entry {
+    struct pathcache_entry *next;
+    char *name;
+    // NULL if the command was not found, new files in PATH invalidate it
+    char *path;
+} pathcache_entry;
+
+// a directory of the daemon's PATH, watched itself or through its nearest existing ancestor
+typedef struct pathcache_dir {
+    char *dir;
+    int wd;
+    int ancestorwd;
+} pathcache_dir;
+
+#define PATHCACHE_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static pathcache_entry *buckets[PATHCACHE_BUCKETS];
+static int inotifyfd = -1;
+static pathcache_dir *dirs;
+static int ndirs;
+// PATH directories with no watch at all, the cache is bypassed while there are any
+static int unwatched = 0;
+// bumped on every invalidation, so that lookups done meanwhile on other threads are not cached
+static unsigned long generation = 0;
+
+static unsigned hash(const char *name) {
+    unsigned h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % PATHCACHE_BUCKETS;
+}
+
+static const char *default_path(void) {
+    const char *path = getenv("PATH");
+    return path ? path : "/usr/local/bin:/usr/bin:/bin";
+}
+
+static bool is_default_path(const char *path) {
+    return !path || !strcmp(path, default_path());
+}
+
+static char *resolve(const char *name, const char *path) {
+    char candidate[PATH_MAX];
+    while (1) {
+        const char *end = strchrnul(path, ':');
+        int dirlen = end - path;
+        // empty PATH entries mean the current directory
+        int len = dirlen ? snprintf(candidate, PATH_MAX, "%.*s/%s", dirlen, path, name)
+                         : snprintf(candidate, PATH_MAX, "%s", name);
+        struct stat st;
+        if (len < PATH_MAX && access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode)) {
+            return strdup(candidate);
+        }
+        if (!*end) {
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+static void flush_entry(pathcache_entry **link) {
+    pathcache_entry *ent = *link;
+    *link = ent->next;
+    free(ent->name);
+    free(ent->path);
+    free(ent);
+}
+
+static void flush_name(const char *name) {
+    for (pathcache_entry **link = &buckets[hash(name)]; *link; link = &(*link)->next) {
+        if (!strcmp((*link)->name, name)) {
+            flush_entry(link);
+            stats.pathcache_invalidations++;
+            return;
+        }
+    }
+}
+
+static void flush_all(void) {
+    for (int i = 0; i < PATHCACHE_BUCKETS; i++) {
+        while (buckets[i]) {
+            flush_entry(&buckets[i]);
+            stats.pathcache_invalidations++;
+        }
+    }
+}
+
+static bool wd_used(int wd) {
+    for (int i = 0; i < ndirs; i++) {
+        if (dirs[i].wd == wd || dirs[i].ancestorwd == wd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void release_wd(int wd) {
+    if (wd >= 0 && !wd_used(wd)) {
+        inotify_rm_watch(inotifyfd, wd);
+    }
+}
+
+// a missing directory is waited for from the closest ancestor that exists
+static int watch_ancestor(const char *dir) {
+    char anc[PATH_MAX];
+    snprintf(anc, PATH_MAX, "%s", dir);
+    while (strcmp(anc, "/") && strcmp(anc, ".")) {
+        char *slash = strrchr(anc, '/');
+        if (!slash) {
+            strcpy(anc, ".");
+        } else if (slash == anc) {
+            anc[1] = 0;
+        } else {
+            *slash = 0;
+        }
+        int wd = inotify_add_watch(inotifyfd, anc, PATHCACHE_MASK | IN_ONLYDIR);
+        if (wd >= 0 || (errno != ENOENT && errno != ENOTDIR)) {
+            return wd;
+        }
+    }
+    return -1;
+}
+
+// (re)watch the PATH directories that lost their watch or did not exist yet
+static void watch_dirs(void) {
+    unwatched = 0;
+    for (int i = 0; i < ndirs; i++) {
+        pathcache_dir *pd = &dirs[i];
+        if (pd->wd < 0) {
+            pd->wd = inotify_add_watch(inotifyfd, pd->dir, PATHCACHE_MASK | IN_ONLYDIR);
+            if (pd->wd < 0 && errno != ENOENT && errno != ENOTDIR) {
+                fprintf(stderr, "cannot watch %s: %s\n", pd->dir, strerror(errno));
+            }
+        }
+        int ancestorwd = pd->ancestorwd;
+        pd->ancestorwd = pd->wd < 0 ? watch_ancestor(pd->dir) : -1;
+        if (ancestorwd != pd->ancestorwd) {
+            release_wd(ancestorwd);
+        }
+        if (pd->wd < 0 && pd->ancestorwd < 0) {
+            unwatched++;
+        }
+    }
+}
+
+int pathcache_init(void) {
+    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyfd < 0) {
+        perror("cannot create inotify instance, path cache disabled");
+        return -1;
+    }
+
+    const char *path = default_path();
+    ndirs = 1;
+    for (const char *ptr = path; *ptr; ptr++) {
+        ndirs += *ptr == ':';
+    }
+    dirs = calloc(ndirs, sizeof(pathcache_dir));
+    for (int i = 0; i < ndirs; i++) {
+        const char *end = strchrnul(path, ':');
+        int dirlen = end - path;
+        // empty PATH entries mean the current directory
+        dirs[i].dir = dirlen ? strndup(path, dirlen) : strdup(".");
+        dirs[i].wd = -1;
+        dirs[i].ancestorwd = -1;
+        path = end + 1;
+    }
+    watch_dirs();
+    return inotifyfd;
+}
+
+static pathcache_entry *find_entry(const char *name) {
+    for (pathcache_entry *ent = buckets[hash(name)]; ent; ent = ent->next) {
+        if (!strcmp(ent->name, name)) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+bool pathcache_peek(const char *name, const char *path, const char **result) {
+    if (inotifyfd < 0 || unwatched || !is_default_path(path)) {
+        return false;
+    }
+    pathcache_entry *ent = find_entry(name);
+    if (!ent) {
+        return false;
+    }
+    stats.pathcache_hits++;
+    *result = ent->path;
+    return true;
+}
+
+char *pathcache_resolve(const char *name, const char *path) {
+    return resolve(name, path ? path : default_path());
+}
+
+void pathcache_insert(const char *name, const char *path, const char *resolved, unsigned long gen) {
+    stats.pathcache_misses++;
+    if (inotifyfd < 0 || unwatched || !is_default_path(path) || gen != generation || find_entry(name)) {
+        return;
+    }
+    unsigned h = hash(name);
+    pathcache_entry *ent = malloc(sizeof(pathcache_entry));
+    ent->name = strdup(name);
+    ent->path = resolved ? strdup(resolved) : NULL;
+    ent->next = buckets[h];
+    buckets[h] = ent;
+}
+
+unsigned long pathcache_generation(void) {
+    return generation;
+}
+
+// a PATH directory went away or moved, it is watched again by path
+static bool drop_wd(int wd) {
+    bool dropped = false;
+    for (int i = 0; i < ndirs; i++) {
+        if (dirs[i].wd == wd) {
+            dirs[i].wd = -1;
+            dropped = true;
+        }
+        if (dirs[i].ancestorwd == wd) {
+            dirs[i].ancestorwd = -1;
+            dropped = true;
+        }
+    }
+    return dropped;
+}
+
+static bool is_dir_wd(int wd) {
+    for (int i = 0; i < ndirs; i++) {
+        if (dirs[i].wd == wd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_ancestor_wd(int wd) {
+    for (int i = 0; i < ndirs; i++) {
+        if (dirs[i].ancestorwd == wd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void pathcache_handle_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t thisread;
+    bool rewatch = false;
+    while ((thisread = read(inotifyfd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + thisread;) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            generation++;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                flush_all();
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                if (ev->mask & IN_MOVE_SELF) {
+                    // the watch follows the directory to wherever it went
+                    inotify_rm_watch(inotifyfd, ev->wd);
+                }
+                rewatch |= drop_wd(ev->wd);
+                flush_all();
+            } else {
+                if (ev->len && is_dir_wd(ev->wd)) {
+                    flush_name(ev->name);
+                }
+                // a missing PATH directory, or one of its parents, may just have been created
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO) && is_ancestor_wd(ev->wd)) {
+                    rewatch = true;
+                }
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (rewatch) {
+        watch_dirs();
+        // files may have appeared before the new watches were in place
+        flush_all();
+    }
+}
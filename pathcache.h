@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+// cache of command name -> absolute path resolutions along $PATH
+// entries are invalidated through inotify watches on the PATH directories,
+// or on the closest existing parent of those that do not exist yet
+
+// returns the inotify fd to be polled, or -1 if the cache is disabled
+int pathcache_init(void);
+// cache only: true if name along path is known, *result is then the resolved path or NULL
+// the result is only valid until the next inotify event is handled
+bool pathcache_peek(const char *name, const char *path, const char **result);
+// uncached and thread-safe, returns a path to be freed, or NULL
+char *pathcache_resolve(const char *name, const char *path);
+// record a pathcache_resolve() result, only kept for the daemon's PATH
+// dropped if entries were invalidated since generation was read
+void pathcache_insert(const char *name, const char *path, const char *resolved, unsigned long generation);
+unsigned long pathcache_generation(void);
+// consume pending inotify events and drop affected entries
+void pathcache_handle_events(void);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+// framed mode is entered by sending the "framed" builtin as a plain command line
+// from then on both directions exchange frames: a header made of the frame type
+// and the payload length in network byte order, followed by the payload
+// the "compress" builtin then lets the server send output as ZDATA frames
+#define UNSH_FRAME_HDRLEN 5
+
+typedef enum unsh_frametype {
+    // client -> server: a command line, without the trailing newline
+    UNSH_FRAME_CMD = 'C',
+    // both ways: input of the foreground job, or output sent to the client
+    UNSH_FRAME_DATA = 'D',
+    // client -> server: end of input of the foreground job
+    UNSH_FRAME_EOF = 'E',
+    // server -> client: the command is over, payload is its 4-byte exit status
+    UNSH_FRAME_DONE = 'X',
+    // server -> client: output as the next part of a raw deflate stream, ending with a sync flush
+    // interleaved with DATA frames, whose output is not part of the stream
+    UNSH_FRAME_ZDATA = 'Z'
+} unsh_frametype;
+
+static inline void unsh_frame_pack(unsigned char *hdr, unsh_frametype type, uint32_t len) {
+    hdr[0] = type;
+    hdr[1] = len >> 24;
+    hdr[2] = len >> 16;
+    hdr[3] = len >> 8;
+    hdr[4] = len;
+}
+
+static inline uint32_t unsh_frame_len(const unsigned char *hdr) {
+    return (uint32_t)hdr[1] << 24 | (uint32_t)hdr[2] << 16 | (uint32_t)hdr[3] << 8 | hdr[4];
+}
@@ -6,6 +6,8 @@
  * Backgrounding added
  */
 
+#include <ctype.h>
+#include <glob.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -67,69 +69,265 @@ static char *readline(void)
 */
 
 
-/* Split the string in words, according to the simple shell grammar. */
-static char **split_in_words(char *line)
+/* Operator tokens. They are recognized by address, so that a quoted "<", ">",
+"|" or "&" stays an ordinary word. They are never freed. */
+static char op_in[] = "<";
+static char op_out[] = ">";
+static char op_pipe[] = "|";
+static char op_bg[] = "&";
+
+static int is_op(char *w)
+{
+    return w == op_in || w == op_out || w == op_pipe || w == op_bg;
+}
+
+
+/* Words being split, and the word being built */
+struct splitter {
+    char **tab;
+    size_t l;
+    char **envp;
+    /* word after quote removal and expansion */
+    char *word;
+    size_t len;
+    /* same word with quoted glob characters escaped, for glob() */
+    char *pat;
+    size_t patlen;
+    size_t cap;
+    /* quotes make a word even when it ends up empty */
+    int started;
+    /* an unquoted *, ? or [ was seen */
+    int globbing;
+    /* a pattern after < or > matched more than one path */
+    int ambiguous;
+};
+
+
+static void push_word(struct splitter *sp, char *w)
+{
+    sp->tab = xrealloc(sp->tab, (sp->l + 1) * sizeof(char *));
+    sp->tab[sp->l++] = w;
+}
+
+
+/* Make room for one more character and the terminating null. */
+static void reserve(struct splitter *sp)
+{
+    if (sp->len + 2 > sp->cap) {
+        sp->cap = sp->cap ? sp->cap * 2 : 64;
+        sp->word = xrealloc(sp->word, sp->cap);
+        sp->pat = xrealloc(sp->pat, 2 * sp->cap);
+    }
+}
+
+
+static void put_char(struct splitter *sp, char c, int quoted)
+{
+    reserve(sp);
+    sp->word[sp->len++] = c;
+    if (c == '\\' || (quoted && (c == '*' || c == '?' || c == '['))) {
+        sp->pat[sp->patlen++] = '\\';
+    } else if (c == '*' || c == '?' || c == '[') {
+        sp->globbing = 1;
+    }
+    sp->pat[sp->patlen++] = c;
+    sp->started = 1;
+}
+
+
+/* End the current word, if any. Unquoted glob characters make it a pattern,
+expanded to the sorted list of matching paths, or kept as is if nothing
+matches. A redirection target must match one path at most. */
+static void end_word(struct splitter *sp)
+{
+    glob_t g;
+    size_t i;
+
+    if (!sp->started) return;
+    /* an empty quoted word may come before any character was put */
+    reserve(sp);
+    sp->word[sp->len] = 0;
+    sp->pat[sp->patlen] = 0;
+    if (sp->globbing && glob(sp->pat, 0, NULL, &g) == 0) {
+        if (g.gl_pathc > 1 && sp->l && (sp->tab[sp->l - 1] == op_in || sp->tab[sp->l - 1] == op_out))
+            sp->ambiguous = 1;
+        for (i = 0; i < g.gl_pathc; i++) {
+            char *w = xmalloc(strlen(g.gl_pathv[i]) + 1);
+            strcpy(w, g.gl_pathv[i]);
+            push_word(sp, w);
+        }
+        globfree(&g);
+    } else {
+        char *w = xmalloc(sp->len + 1);
+        strcpy(w, sp->word);
+        push_word(sp, w);
+    }
+    sp->len = 0;
+    sp->patlen = 0;
+    sp->started = 0;
+    sp->globbing = 0;
+}
+
+
+static const char *lookup_var(char **envp, const char *name, size_t len)
+{
+    if (!envp) return NULL;
+    for (; *envp; envp++) {
+        if (!strncmp(*envp, name, len) && (*envp)[len] == '=') return *envp + len + 1;
+    }
+    return NULL;
+}
+
+
+/* Expand $NAME or ${NAME} at *cur. Unquoted, the value is split on whitespace
+like the shell does. Returns -1 on a malformed ${. */
+static int expand_var(struct splitter *sp, char **cur, int quoted)
+{
+    char *name = *cur + 1;
+    size_t len = 0;
+    const char *value;
+
+    if (*name == '{') {
+        name++;
+        while (name[len] && name[len] != '}') len++;
+        if (name[len] != '}' || len == 0) return -1;
+        *cur = name + len + 1;
+    } else if (isdigit((unsigned char)*name)) {
+        /* no positional parameters in a session, always empty */
+        *cur = name + 1;
+        return 0;
+    } else if (*name == '_' || isalpha((unsigned char)*name)) {
+        while (name[len] == '_' || isalnum((unsigned char)name[len])) len++;
+        *cur = name + len;
+    } else {
+        /* not a variable, a plain $ */
+        put_char(sp, '$', quoted);
+        (*cur)++;
+        return 0;
+    }
+
+    value = lookup_var(sp->envp, name, len);
+    if (!value) return 0;
+    for (; *value; value++) {
+        if (!quoted && (*value == ' ' || *value == '\t' || *value == '\n')) {
+            end_word(sp);
+        } else {
+            put_char(sp, *value, quoted);
+        }
+    }
+    return 0;
+}
+
+
+/* Split the string in words, according to the simple shell grammar, with
+quotes, backslash escapes, variables from envp and globbing.
+Returns NULL and sets *err if the line is malformed. */
+static char **split_in_words(char *line, char **envp, char **err)
 {
+    struct splitter sp;
     char *cur = line;
-    char **tab = 0;
-    size_t l = 0;
     char c;
+    size_t i;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.envp = envp;
 
     while ((c = *cur) != 0) {
-        char *w = 0;
-        char *start;
         switch (c) {
         case ' ':
         case '\t':
+        case '\n':
             /* Ignore any whitespace */
+            end_word(&sp);
             cur++;
             break;
         case '<':
-            w = "<";
+            end_word(&sp);
+            push_word(&sp, op_in);
             cur++;
             break;
         case '>':
-            w = ">";
+            end_word(&sp);
+            push_word(&sp, op_out);
             cur++;
             break;
         case '|':
-            w = "|";
+            end_word(&sp);
+            push_word(&sp, op_pipe);
             cur++;
             break;
         case '&':
-            w = "&";
+            end_word(&sp);
+            push_word(&sp, op_bg);
             cur++;
             break;
-        default:
-            /* Another word */
-            start = cur;
-            while (c) {
-                c = *++cur;
-                switch (c) {
-                case 0:
-                case ' ':
-                case '\t':
-                case '<':
-                case '>':
-                case '|':
-                case '&':
-                    c = 0;
-                    break;
-                default: ;
+        case '\'':
+            /* Everything is literal up to the closing quote */
+            sp.started = 1;
+            cur++;
+            while (*cur && *cur != '\'') put_char(&sp, *cur++, 1);
+            if (!*cur) {
+                *err = "unterminated quote";
+                goto error;
+            }
+            cur++;
+            break;
+        case '"':
+            /* Variables are expanded, \ only escapes $ ` " \ */
+            sp.started = 1;
+            cur++;
+            while (*cur && *cur != '"') {
+                if (*cur == '\\' && cur[1] && strchr("$`\"\\", cur[1])) {
+                    put_char(&sp, cur[1], 1);
+                    cur += 2;
+                } else if (*cur == '$') {
+                    if (expand_var(&sp, &cur, 1) < 0) {
+                        *err = "bad substitution";
+                        goto error;
+                    }
+                } else {
+                    put_char(&sp, *cur++, 1);
                 }
             }
-            w = xmalloc((cur - start + 1) * sizeof(char));
-            strncpy(w, start, cur - start);
-            w[cur - start] = 0;
-        }
-        if (w) {
-            tab = xrealloc(tab, (l + 1) * sizeof(char *));
-            tab[l++] = w;
+            if (!*cur) {
+                *err = "unterminated quote";
+                goto error;
+            }
+            cur++;
+            break;
+        case '\\':
+            /* A trailing backslash is dropped */
+            if (cur[1]) put_char(&sp, cur[1], 1);
+            cur += cur[1] ? 2 : 1;
+            break;
+        case '$':
+            if (expand_var(&sp, &cur, 0) < 0) {
+                *err = "bad substitution";
+                goto error;
+            }
+            break;
+        default:
+            put_char(&sp, c, 0);
+            cur++;
         }
     }
-    tab = xrealloc(tab, (l + 1) * sizeof(char *));
-    tab[l++] = 0;
-    return tab;
+    end_word(&sp);
+    if (sp.ambiguous) {
+        *err = "ambiguous redirect";
+        goto error;
+    }
+    free(sp.word);
+    free(sp.pat);
+    push_word(&sp, 0);
+    return sp.tab;
+error:
+    for (i = 0; i < sp.l; i++) {
+        if (!is_op(sp.tab[i])) free(sp.tab[i]);
+    }
+    free(sp.tab);
+    free(sp.word);
+    free(sp.pat);
+    return NULL;
 }
 
 
@@ -152,12 +350,55 @@ static void freecmd(struct cmdline *s)
 {
     if (s->in) free(s->in);
     if (s->out) free(s->out);
-    if (s->backgrounded) free(s->backgrounded);
+    /* backgrounded points to the static "&" token, it is not freed */
     if (s->seq) freeseq(s->seq);
 }
 
 
-struct cmdline *readcmd(char *line)
+static char *xstrdup(const char *str)
+{
+    char *p;
+
+    if (!str) return 0;
+    p = xmalloc(strlen(str) + 1);
+    strcpy(p, str);
+    return p;
+}
+
+
+struct cmdline *cmddup(struct cmdline *s)
+{
+    struct cmdline *d = xmalloc(sizeof(struct cmdline));
+    size_t i, j;
+
+    d->err = s->err;
+    d->in = xstrdup(s->in);
+    d->out = xstrdup(s->out);
+    /* the static "&" token */
+    d->backgrounded = s->backgrounded;
+    d->seq = 0;
+    if (!s->seq) return d;
+    for (i = 0; s->seq[i]; i++);
+    d->seq = xmalloc((i + 1) * sizeof(char **));
+    for (i = 0; s->seq[i]; i++) {
+        for (j = 0; s->seq[i][j]; j++);
+        d->seq[i] = xmalloc((j + 1) * sizeof(char *));
+        for (j = 0; s->seq[i][j]; j++) d->seq[i][j] = xstrdup(s->seq[i][j]);
+        d->seq[i][j] = 0;
+    }
+    d->seq[i] = 0;
+    return d;
+}
+
+
+void cmdfree(struct cmdline *s)
+{
+    freecmd(s);
+    free(s);
+}
+
+
+struct cmdline *readcmd(char *line, char **envp)
 {
     static struct cmdline *static_cmdline = 0;
     struct cmdline *s = static_cmdline;
@@ -167,6 +408,7 @@ struct cmdline *readcmd(char *line)
     char **cmd;
     char ***seq;
     size_t cmd_len, seq_len;
+    char *err = 0;
 
     if (line == NULL) {
         if (s) {
@@ -183,54 +425,53 @@ struct cmdline *readcmd(char *line)
     seq[0] = 0;
     seq_len = 0;
 
-    words = split_in_words(line);
+    words = split_in_words(line, envp, &err);
 
     if (!s)
         static_cmdline = s = xmalloc(sizeof(struct cmdline));
     else
         freecmd(s);
-    s->err = 0;
+    s->err = err;
     s->in = 0;
     s->out = 0;
     s->backgrounded = 0;
     s->seq = 0;
 
+    if (!words) {
+        free(cmd);
+        free(seq);
+        return s;
+    }
+
     i = 0;
     while ((w = words[i++]) != 0) {
-        switch (w[0]) {
-        case '&':
+        if (w == op_bg) {
             if(s->backgrounded){
             s->err = "error on &";
             goto error;
             }
-            s->backgrounded = &w[0];
-            break;
-        case '<':
-            /* Tricky : the word can only be "<" */
+            s->backgrounded = w;
+        } else if (w == op_in) {
             if (s->in) {
                 s->err = "only one input file supported";
                 goto error;
             }
-            if (words[i] == 0) {
+            if (words[i] == 0 || is_op(words[i])) {
                 s->err = "filename missing for input redirection";
                 goto error;
             }
             s->in = words[i++];
-            break;
-        case '>':
-            /* Tricky : the word can only be ">" */
+        } else if (w == op_out) {
             if (s->out) {
                 s->err = "only one output file supported";
                 goto error;
             }
-            if (words[i] == 0) {
+            if (words[i] == 0 || is_op(words[i])) {
                 s->err = "filename missing for output redirection";
                 goto error;
             }
             s->out = words[i++];
-            break;
-        case '|':
-            /* Tricky : the word can only be "|" */
+        } else if (w == op_pipe) {
             if (cmd_len == 0) {
                 s->err = "misplaced pipe";
                 goto error;
@@ -243,8 +484,7 @@ struct cmdline *readcmd(char *line)
             cmd = xmalloc(sizeof(char *));
             cmd[0] = 0;
             cmd_len = 0;
-            break;
-        default:
+        } else {
             cmd = xrealloc(cmd, (cmd_len + 2) * sizeof(char *));
             cmd[cmd_len++] = w;
             cmd[cmd_len] = 0;
@@ -266,15 +506,7 @@ struct cmdline *readcmd(char *line)
     return s;
 error:
     while ((w = words[i++]) != 0) {
-        switch (w[0]) {
-        case '<':
-        case '>':
-        case '|':
-        case '&':
-            break;
-        default:
-            free(w);
-        }
+        if (!is_op(w)) free(w);
     }
     free(words);
     freeseq(seq);
@@ -288,9 +520,6 @@ error:
         free(s->out);
         s->out = 0;
     }
-    if (s->backgrounded) {
-        free(s->backgrounded);
-        s->out = 0;
-    }
+    s->backgrounded = 0;
     return s;
 }
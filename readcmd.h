@@ -7,9 +7,15 @@
 #ifndef __READCMD_H
 #define __READCMD_H
 
-/* Read a command line from input stream. Return null when input closed.
+/* Parse a command line. Variables are looked up in envp, a null-terminated
+array of "NAME=value" strings, which may be null.
 Display an error and call exit() in case of memory exhaustion. */
-struct cmdline *readcmd(char *line);
+struct cmdline *readcmd(char *line, char **envp);
+
+/* The structure returned by readcmd() is reused by the next call. cmddup()
+makes a copy that stays valid until it is passed to cmdfree(). */
+struct cmdline *cmddup(struct cmdline *s);
+void cmdfree(struct cmdline *s);
 
 
 /* Structure returned by readcmd() */
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "readcmd.h"
+#include "record.h"
+
+static int recfd = -1;
+static uint32_t nextsession = 0;
+static char buf[UNSH_RECORD_BUFSIZE];
+static size_t buflen = 0;
+
+int record_open(const char *path) {
+    recfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (recfd < 0) {
+        perror("cannot open record file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(recfd, &st) < 0) {
+        perror("cannot stat record file");
+        close(recfd);
+        recfd = -1;
+        return -1;
+    }
+    if (!st.st_size) {
+        memcpy(buf, UNSH_RECORD_MAGIC, sizeof(UNSH_RECORD_MAGIC) - 1);
+        buflen = sizeof(UNSH_RECORD_MAGIC) - 1;
+    }
+    return 0;
+}
+
+bool record_enabled(void) {
+    return recfd >= 0;
+}
+
+void record_flush(void) {
+    if (!buflen) {
+        return;
+    }
+    // whole buffers at a time, so that two unshd appending during a restart do not mix records
+    if (write(recfd, buf, buflen) != (ssize_t)buflen) {
+        perror("cannot write record file");
+    }
+    buflen = 0;
+}
+
+static void record_write(unsh_recsession *rs, unsh_recordtype type, const void *payload, size_t len) {
+    // a command line expanded past the buffer is left out
+    if (sizeof(unsh_record_header) + len > sizeof(buf)) {
+        return;
+    }
+    if (buflen + sizeof(unsh_record_header) + len > sizeof(buf)) {
+        record_flush();
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsh_record_header hdr = {0};
+    hdr.ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    hdr.pid = getpid();
+    hdr.session = rs->id;
+    hdr.len = len;
+    hdr.type = type;
+    memcpy(buf + buflen, &hdr, sizeof(hdr));
+    memcpy(buf + buflen + sizeof(hdr), payload, len);
+    buflen += sizeof(hdr) + len;
+}
+
+unsh_recsession *record_session_new(void) {
+    if (recfd < 0) {
+        return NULL;
+    }
+    unsh_recsession *ret = calloc(1, sizeof(unsh_recsession));
+    ret->id = ++nextsession;
+    record_write(ret, RECORD_OPEN, NULL, 0);
+    return ret;
+}
+
+static char *put_word(char *ptr, const char *word) {
+    *ptr++ = '\'';
+    for (; *word; word++) {
+        if (*word == '\'') {
+            ptr = stpcpy(ptr, "'\\''");
+        } else {
+            *ptr++ = *word;
+        }
+    }
+    *ptr++ = '\'';
+    *ptr++ = ' ';
+    return ptr;
+}
+
+void record_command(unsh_recsession *rs, const char *line, struct cmdline *cmd) {
+    if (!rs) {
+        return;
+    }
+    if (cmd->err || !cmd->seq) {
+        record_write(rs, RECORD_CMD, line, strlen(line));
+        return;
+    }
+    // words are expanded already, quoting them keeps them as they are
+    size_t len = 8;
+    for (char ***seq = cmd->seq; *seq; seq++) {
+        for (char **word = *seq; *word; word++) {
+            len += strlen(*word) * 4 + 5;
+        }
+    }
+    len += cmd->in ? strlen(cmd->in) * 4 + 5 : 0;
+    len += cmd->out ? strlen(cmd->out) * 4 + 5 : 0;
+    char *text = malloc(len);
+    char *ptr = text;
+    for (char ***seq = cmd->seq; *seq; seq++) {
+        if (seq != cmd->seq) {
+            ptr = stpcpy(ptr, "| ");
+        }
+        for (char **word = *seq; *word; word++) {
+            ptr = put_word(ptr, *word);
+        }
+    }
+    if (cmd->in) {
+        ptr = stpcpy(ptr, "< ");
+        ptr = put_word(ptr, cmd->in);
+    }
+    if (cmd->out) {
+        ptr = stpcpy(ptr, "> ");
+        ptr = put_word(ptr, cmd->out);
+    }
+    if (cmd->backgrounded) {
+        ptr = stpcpy(ptr, "& ");
+    }
+    if (ptr != text) {
+        ptr--;
+    }
+    record_write(rs, RECORD_CMD, text, ptr - text);
+    free(text);
+}
+
+void record_done(unsh_recsession *rs, int status) {
+    if (!rs) {
+        return;
+    }
+    unsh_record_done done = {0};
+    done.status = status;
+    done.in = rs->in;
+    done.out = rs->out;
+    rs->in = rs->out = 0;
+    record_write(rs, RECORD_DONE, &done, sizeof(done));
+}
+
+void record_session_end(unsh_recsession *rs) {
+    if (!rs) {
+        return;
+    }
+    record_write(rs, RECORD_CLOSE, NULL, 0);
+    free(rs);
+}
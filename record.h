@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cmdline;
+
+// session recording, enabled with "unshd -r FILE" and replayed by unshreplay
+// only command lines and byte counts are kept, not the data itself
+
+// file: the magic, then records, each a header followed by len bytes of payload
+// the file is appended to, also by the unshd that takes over on restart
+#define UNSH_RECORD_MAGIC "UNSHREC1"
+
+typedef enum unsh_recordtype {
+    // a client connected, no payload
+    RECORD_OPEN = 'O',
+    // payload: the command line, rebuilt from readcmd() with every word quoted
+    // so that it parses back to the same words, or as received if it did not parse
+    RECORD_CMD = 'C',
+    // payload: an unsh_record_done
+    RECORD_DONE = 'X',
+    // the client went away, no payload
+    RECORD_CLOSE = 'Q'
+} unsh_recordtype;
+
+// ts is CLOCK_MONOTONIC in ns, sessions are numbered per unshd process
+typedef struct unsh_record_header {
+    uint64_t ts;
+    uint32_t pid;
+    uint32_t session;
+    uint32_t len;
+    uint8_t type;
+    uint8_t pad[3];
+} unsh_record_header;
+
+// bytes of input and output of the command, including those of its background jobs
+typedef struct unsh_record_done {
+    int32_t status;
+    uint32_t pad;
+    uint64_t in;
+    uint64_t out;
+} unsh_record_done;
+
+typedef struct unsh_recsession {
+    uint32_t id;
+    uint64_t in;
+    uint64_t out;
+} unsh_recsession;
+
+int record_open(const char *path);
+bool record_enabled(void);
+// NULL when not recording
+unsh_recsession *record_session_new(void);
+void record_command(unsh_recsession *rs, const char *line, struct cmdline *cmd);
+void record_done(unsh_recsession *rs, int status);
+// writes the close record and frees rs
+void record_session_end(unsh_recsession *rs);
+// write out what was recorded, once per round of the event loop
+void record_flush(void);
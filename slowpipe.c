@@ -1,25 +1,279 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#define DELAY_USEC 200000
+// copies stdin to stdout at a shaped pace, to exercise flow control
+// as a pipeline stage it is a slow producer, with -n it is a slow consumer
+// without options, one byte every 200 ms
+
+typedef struct shaping {
+    // bytes per second, 0 for no limit
+    double rate;
+    // most bytes let through at once after an idle period
+    size_t burst;
+    // bytes per read
+    size_t chunk;
+    // random extra delay before each chunk, up to this
+    long jitter_ms;
+    // pause for stall_ms after every stall_every bytes
+    size_t stall_every;
+    long stall_ms;
+    bool discard;
+    bool verbose;
+} shaping;
+
+// same sequence for the same seed on every libc, so runs can be replayed
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // splitmix64
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pause_for(double seconds) {
+    if (seconds <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+// a byte count with an optional k, m or g suffix
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s || *s == '-' || errno) {
+        return -1;
+    }
+    switch (*end) {
+        case 'g':
+        case 'G':
+            n *= 1024;
+            // fall through
+        case 'm':
+        case 'M':
+            n *= 1024;
+            // fall through
+        case 'k':
+        case 'K':
+            n *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end) {
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+static int parse_ms(const char *s, long *out) {
+    char *end;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end || errno || n < 0) {
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+static int write_all(const char *buf, size_t len) {
+    while (len) {
+        ssize_t thiswrite = write(1, buf, len);
+        if (thiswrite < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += thiswrite;
+        len -= thiswrite;
+    }
+    return 0;
+}
+
+static int shape(const shaping *sh) {
+    char *buf = malloc(sh->chunk);
+    if (!buf) {
+        perror("cannot allocate buffer");
+        return 1;
+    }
+    // token bucket, starts full
+    double tokens = sh->burst;
+    double last = now(), start = last;
+    size_t sincestall = 0;
+    unsigned long long total = 0;
+    int ret = 0;
 
-int main() {
     while (1) {
-        char dummy;
-        ssize_t thisread = read(0, &dummy, 1);
+        ssize_t thisread = read(0, buf, sh->chunk);
         if (thisread < 0) {
-            return 1;
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cannot read");
+            ret = 1;
+            break;
         } else if (thisread == 0) {
-            return 0;
+            break;
         }
-        ssize_t thiswrite = write(1, &dummy, 1);
-        if (thiswrite < 0) {
-            return 1;
-        } else if (thiswrite == 0) {
-            return 0;
+
+        // a chunk bigger than the burst goes out in several pieces
+        for (size_t off = 0; off < (size_t)thisread;) {
+            size_t piece = (size_t)thisread - off;
+            if (piece > sh->burst) {
+                piece = sh->burst;
+            }
+            if (sh->rate > 0) {
+                double t = now();
+                tokens += (t - last) * sh->rate;
+                if (tokens > sh->burst) {
+                    tokens = sh->burst;
+                }
+                last = t;
+                if (tokens < piece) {
+                    pause_for((piece - tokens) / sh->rate);
+                    tokens = piece;
+                    last = now();
+                }
+                tokens -= piece;
+            }
+            if (sh->jitter_ms) {
+                pause_for((rng_next() % (uint64_t)(sh->jitter_ms + 1)) / 1e3);
+            }
+            if (!sh->discard && write_all(buf + off, piece) < 0) {
+                perror("cannot write");
+                ret = 1;
+                goto out;
+            }
+            off += piece;
+            total += piece;
+            sincestall += piece;
+            if (sh->stall_every && sincestall >= sh->stall_every) {
+                sincestall %= sh->stall_every;
+                pause_for(sh->stall_ms / 1e3);
+                // a stall does not earn a burst afterwards
+                tokens = 0;
+                last = now();
+            }
         }
-        usleep(DELAY_USEC);
     }
-    return 0;
+
+out:
+    if (sh->verbose) {
+        double elapsed = now() - start;
+        fprintf(stderr, "slowpipe: %llu bytes in %.3f s, %.0f B/s\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0);
+    }
+    free(buf);
+    return ret;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [-r RATE] [-b BURST] [-c CHUNK] [-j JITTER_MS] [-s EVERY:MS] [-S SEED] [-n] [-v]\n"
+        "  -r  bytes per second, 0 for no limit (default 5)\n"
+        "  -b  bytes let through at once after an idle period (default CHUNK)\n"
+        "  -c  bytes per read (default 1)\n"
+        "  -j  random delay of up to JITTER_MS before each chunk\n"
+        "  -s  stall for MS after every EVERY bytes\n"
+        "  -S  seed of the random delays (default 1)\n"
+        "  -n  discard the input instead of copying it, as a slow consumer\n"
+        "  -v  print the achieved rate on exit\n"
+        "sizes take a k, m or g suffix\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    shaping sh = {0};
+    size_t rate = 5;
+    sh.chunk = 1;
+    rng_state = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:c:j:s:S:nv")) != -1) {
+        char *colon;
+        switch (opt) {
+            case 'r':
+                if (parse_size(optarg, &rate) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (parse_size(optarg, &sh.burst) < 0 || !sh.burst) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (parse_size(optarg, &sh.chunk) < 0 || !sh.chunk) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'j':
+                if (parse_ms(optarg, &sh.jitter_ms) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                colon = strchr(optarg, ':');
+                if (!colon) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                *colon = 0;
+                if (parse_size(optarg, &sh.stall_every) < 0 || parse_ms(colon + 1, &sh.stall_ms) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'S':
+                rng_state = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                sh.discard = true;
+                break;
+            case 'v':
+                sh.verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    sh.rate = rate;
+    if (!sh.burst) {
+        sh.burst = sh.chunk;
+    }
+    return shape(&sh);
 }
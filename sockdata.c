@@ -2,35 +2,96 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 
+#include "compress.h"
 #include "config.h"
+#include "record.h"
 #include "sockdata.h"
+#include "stats.h"
+#include "xfer.h"
 
-const char *unsh_sockettype_strings[6] = {
+static unsh_socket *graveyard = NULL;
+// sockets waiting for another turn, served in the next round
+static unsh_socket *readyhead = NULL;
+static unsh_socket **readytail = &readyhead;
+
+// spare line buffers, shared by all clients
+static char *linebuf_pool[UNSH_LINEBUF_POOL];
+static size_t linebuf_pooled = 0;
+
+char *linebuf_get(void) {
+    if (linebuf_pooled) {
+        return linebuf_pool[--linebuf_pooled];
+    }
+    return malloc(UNSH_LINE_MAX + 1);
+}
+
+void linebuf_put(char *buf) {
+    if (!buf) {
+        return;
+    }
+    if (linebuf_pooled < UNSH_LINEBUF_POOL) {
+        linebuf_pool[linebuf_pooled++] = buf;
+    } else {
+        free(buf);
+    }
+}
+
+const char *unsh_sockettype_strings[9] = {
     "None",
     "Server",
     "Client",
     "Proc-In",
     "Proc-Out",
-    "Signal"
+    "Signal",
+    "Inotify",
+    "Offload",
+    "Handoff"
 };
 
 unsh_socket *newsock(int fd, unsh_sockettype socktype, bool initialize) {
     unsh_socket *ret = calloc(1, sizeof(unsh_socket));
+    stats.sockets_live++;
     ret->fd = fd;
     ret->socktype = socktype;
     if (initialize) {
         switch (socktype) {
             case SOCKETTYPE_CLIENT:
                 ret->sockaff.client.state = CLIENTSTATE_COMMAND;
-                ret->sockaff.client.haspipe = false;
-                ret->sockaff.client.linebuf = malloc(UNSH_LINE_MAX + 1);
+                ret->sockaff.client.linebuf = NULL;
                 ret->sockaff.client.linelen = 0;
-                //ret->sockaff.client.readoutfd = -1;
-                ret->sockaff.client.writeinfd = -1;
+                ret->sockaff.client.stdinsock = NULL;
+                ret->sockaff.client.attached = NULL;
+                ret->sockaff.client.jobs = NULL;
+                ret->sockaff.client.spawnreq = NULL;
+                ret->sockaff.client.zout = NULL;
+                ret->sockaff.client.xfer = NULL;
+                ret->sockaff.client.cgroup = NULL;
+                ret->sockaff.client.rec = NULL;
+                ret->sockaff.client.fgjob = NULL;
+                ret->sockaff.client.events = EPOLLIN | EPOLLRDHUP;
+                ret->sockaff.client.rdhup = false;
+                ret->sockaff.client.eof = false;
+                ret->sockaff.client.framed = false;
+                ret->sockaff.client.framehdrlen = 0;
+                ret->sockaff.client.frameleft = 0;
+                ret->sockaff.client.env.vars = NULL;
+                ret->sockaff.client.env.count = 0;
+                break;
+            case SOCKETTYPE_PROC_IN:
+                ret->sockaff.proc_in.clientsock = NULL;
+                ret->sockaff.proc_in.polling = false;
+                ret->sockaff.proc_in.pipesize = 0;
                 break;
             case SOCKETTYPE_PROC_OUT:
                 ret->sockaff.proc_out.clientsock = NULL;
+                ret->sockaff.proc_out.job = NULL;
+                ret->sockaff.proc_out.subscribers = NULL;
+                ret->sockaff.proc_out.nsubscribers = 0;
+                ret->sockaff.proc_out.name = NULL;
+                ret->sockaff.proc_out.paused = false;
+                ret->sockaff.proc_out.pipesize = 0;
                 break;
             default:
                 break;
@@ -45,12 +106,77 @@ void freesock(unsh_socket *sock) {
     }
     switch (sock->socktype) {
         case SOCKETTYPE_CLIENT:
-            free(sock->sockaff.client.linebuf);
+            linebuf_put(sock->sockaff.client.linebuf);
+            outq_clear(&sock->sockaff.client.inq);
+            outq_clear(&sock->sockaff.client.outq);
+            env_clear(&sock->sockaff.client.env);
+            zout_free(sock->sockaff.client.zout);
+            xfer_free(sock->sockaff.client.xfer);
+            free(sock->sockaff.client.cgroup);
+            record_session_end(sock->sockaff.client.rec);
             break;
         case SOCKETTYPE_PROC_OUT:
+            free(sock->sockaff.proc_out.subscribers);
+            free(sock->sockaff.proc_out.name);
             break;
         default:
             break;
     }
+    stats.sockets_live--;
     free(sock);
 }
+
+void retiresock(unsh_socket *sock) {
+    if (sock->dead) {
+        return;
+    }
+    sock->dead = true;
+    sock->nextdead = graveyard;
+    graveyard = sock;
+}
+
+void sock_requeue(unsh_socket *sock, uint32_t events) {
+    if (sock->dead) {
+        return;
+    }
+    if (!sock->readyevents) {
+        sock->nextready = NULL;
+        *readytail = sock;
+        readytail = &sock->nextready;
+    }
+    sock->readyevents |= events;
+}
+
+bool sock_ready_pending(void) {
+    return readyhead != NULL;
+}
+
+unsh_socket *sock_take_ready(void) {
+    unsh_socket *ret = readyhead;
+    readyhead = NULL;
+    readytail = &readyhead;
+    return ret;
+}
+
+size_t reapsocks(void) {
+    // sockets retired after being queued do not get their turn
+    unsh_socket **link = &readyhead;
+    while (*link) {
+        if ((*link)->dead) {
+            (*link)->readyevents = 0;
+            *link = (*link)->nextready;
+        } else {
+            link = &(*link)->nextready;
+        }
+    }
+    readytail = link;
+
+    size_t ret = 0;
+    while (graveyard) {
+        unsh_socket *sock = graveyard;
+        graveyard = sock->nextdead;
+        freesock(sock);
+        ret++;
+    }
+    return ret;
+}
@@ -2,8 +2,19 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "env.h"
+#include "protocol.h"
 
 typedef struct unsh_socket unsh_socket;
+typedef struct unsh_job unsh_job;
+typedef struct unsh_spawnreq unsh_spawnreq;
+typedef struct unsh_zout unsh_zout;
+typedef struct unsh_xfer unsh_xfer;
+typedef struct unsh_cgsession unsh_cgsession;
+typedef struct unsh_recsession unsh_recsession;
 
 typedef enum unsh_sockettype {
     SOCKETTYPE_NONE,
@@ -11,36 +22,105 @@ typedef enum unsh_sockettype {
     SOCKETTYPE_CLIENT,
     SOCKETTYPE_PROC_IN,
     SOCKETTYPE_PROC_OUT,
-    SOCKETTYPE_SIGNAL
+    SOCKETTYPE_SIGNAL,
+    SOCKETTYPE_INOTIFY,
+    SOCKETTYPE_OFFLOAD,
+    SOCKETTYPE_HANDOFF
 } unsh_sockettype;
 
 typedef enum unsh_sockaff_client_state {
     CLIENTSTATE_UNKNOWN,
     CLIENTSTATE_COMMAND,
     CLIENTSTATE_INPUT,
+    CLIENTSTATE_ATTACHED,
+    CLIENTSTATE_WAITING,
+    // redirections or command lookups are in progress on the helpers
+    CLIENTSTATE_SPAWNING,
+    // a file is being sent or received by "get" or "put"
+    CLIENTSTATE_GET,
+    CLIENTSTATE_PUT,
     CLIENTSTATE_CLOSED
 } unsh_sockaff_client_state;
 
+// laid out largest first, idle connections are meant to be cheap
 typedef struct unsh_sockaff_client {
-    unsh_sockaff_client_state state;
-    bool haspipe;
+    unsh_outq outq;
+    // input not yet accepted by the foreground job
+    unsh_outq inq;
+    // variables set with "export", passed to the jobs
+    unsh_env env;
+    // only held while a command line is being received, see linebuf_get
     char *linebuf;
-    size_t linelen;
-    //int readoutfd;
-    int writeinfd;
+    // proc_in socket feeding the foreground job, polled only while the pipe is full
+    unsh_socket *stdinsock;
+    // shared pipeline of another client that this client watches
+    unsh_socket *attached;
+    // job table, ordered by job number
+    unsh_job *jobs;
+    unsh_job *fgjob;
+    // pipeline being prepared while in CLIENTSTATE_SPAWNING
+    unsh_spawnreq *spawnreq;
+    // output compression, after the "compress" builtin
+    unsh_zout *zout;
+    // file transfer while in CLIENTSTATE_GET or CLIENTSTATE_PUT
+    unsh_xfer *xfer;
+    // cgroup limits and usage, after the first pipeline or "limit" builtin
+    unsh_cgsession *cgroup;
+    // NULL unless unshd records sessions
+    unsh_recsession *rec;
+    int nextjobid;
+    // job number waited for by the "wait" builtin, 0 for all
+    int waitjob;
+    // events currently registered with epoll
+    uint32_t events;
+    uint32_t frameleft;
+    uint16_t linelen;
+    // an unsh_sockaff_client_state
+    uint8_t state;
+    // framed mode, and the header of the frame being received
+    uint8_t framehdrlen;
+    unsigned char framehdr[UNSH_FRAME_HDRLEN];
+    bool framed : 1;
+    // "priority batch": served after interactive sessions, with nicer pipelines
+    bool batch : 1;
+    // the client shut down its sending side, and we read up to its EOF
+    bool rdhup : 1;
+    bool eof : 1;
 } unsh_sockaff_client;
 
 typedef struct unsh_sockaff_proc_in {
     unsh_socket *clientsock;
+    bool polling;
+    int pipesize;
 } unsh_sockaff_proc_in;
 
 typedef struct unsh_sockaff_proc_out {
+    // client that spawned the pipeline, NULL once it has gone away
     unsh_socket *clientsock;
+    unsh_job *job;
+    // every client receiving the output, including clientsock
+    unsh_socket **subscribers;
+    size_t nsubscribers;
+    // non-null if the pipeline can be attached by other clients
+    char *name;
+    // spawned by a batch session
+    bool batch;
+    unsh_socket *nextshared;
+    // reading is suspended until the owner drains its output queue
+    bool paused;
+    int pipesize;
 } unsh_sockaff_proc_out;
 
 typedef struct unsh_socket {
     int fd;
-    unsh_sockettype socktype;
+    // an unsh_sockettype
+    uint8_t socktype;
+    // retired sockets may still be referenced by pending events until the batch is over
+    bool dead;
+    unsh_socket *nextdead;
+    // events of another turn asked for by a handler, 0 if not queued, see sock_requeue
+    uint32_t readyevents;
+    unsh_socket *nextready;
     union {
         unsh_sockaff_client client;
         unsh_sockaff_proc_in proc_in;
@@ -50,5 +130,16 @@ typedef struct unsh_socket {
 
 unsh_socket *newsock(int fd, unsh_sockettype socktype, bool initialize);
 void freesock(unsh_socket *sock);
+void retiresock(unsh_socket *sock);
+// returns the number of sockets freed
+size_t reapsocks(void);
+// epoll is edge-triggered, a handler that stops before EAGAIN queues its socket for another turn
+void sock_requeue(unsh_socket *sock, uint32_t events);
+bool sock_ready_pending(void);
+// the sockets queued so far, linked by nextready, still marked as queued until served
+unsh_socket *sock_take_ready(void);
+// buffers of UNSH_LINE_MAX + 1 bytes, recycled through a shared pool
+char *linebuf_get(void);
+void linebuf_put(char *buf);
 
-const char *unsh_sockettype_strings[6];
+extern const char *unsh_sockettype_strings[9];
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+unsh_stats stats = {0};
+
+static unsigned long process_rss_kb(void) {
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "re");
+    if (!f) {
+        return 0;
+    }
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static unsigned long process_fds(void) {
+    unsigned long ret = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return 0;
+    }
+    while (readdir(dir)) {
+        ret++;
+    }
+    closedir(dir);
+    // ".", ".." and the fd of dir itself
+    return ret > 3 ? ret - 3 : 0;
+}
+
+size_t stats_format(char *buf, size_t size) {
+    int len = snprintf(buf, size,
+        "pathcache.hits %lu\n"
+        "pathcache.misses %lu\n"
+        "pathcache.invalidations %lu\n"
+        "pipe.grows %lu\n"
+        "compress.in %lu\n"
+        "compress.out %lu\n"
+        "compress.bypassed %lu\n"
+        "compress.cpu_us %lu\n"
+        "xfer.sent %lu\n"
+        "xfer.received %lu\n"
+        "cgroup.jobs %lu\n"
+        "cgroup.cpu_us %llu\n"
+        "sockets.live %lu\n"
+        "process.rss_kb %lu\n"
+        "process.fds %lu\n"
+        "loop.rounds %lu\n"
+        "loop.events %lu\n"
+        "loop.requeued %lu\n"
+        "loop.wasted %lu\n"
+        "loop.batch %d\n"
+        "loop.events_per_s %.0f\n"
+        "loop.wasted_per_s %.0f\n",
+        stats.pathcache_hits,
+        stats.pathcache_misses,
+        stats.pathcache_invalidations,
+        stats.pipe_grows,
+        stats.compress_in,
+        stats.compress_out,
+        stats.compress_bypassed,
+        stats.compress_ns / 1000,
+        stats.xfer_sent,
+        stats.xfer_received,
+        stats.cgroup_jobs,
+        stats.cgroup_cpu_us,
+        stats.sockets_live,
+        process_rss_kb(),
+        process_fds(),
+        stats.loop_rounds,
+        stats.loop_events,
+        stats.loop_requeued,
+        stats.loop_wasted,
+        stats.loop_batch,
+        stats.loop_events_rate,
+        stats.loop_wasted_rate);
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+size_t stats_printf(char *buf, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+void stats_loop_tick(void) {
+    static struct timespec last;
+    static unsigned long lastevents, lastwasted;
+    struct timespec now;
+    // a coarse clock is enough for once a second, and costs nothing per round
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+    if (elapsed < 1) {
+        return;
+    }
+    if (last.tv_sec) {
+        stats.loop_events_rate = (stats.loop_events - lastevents) / elapsed;
+        stats.loop_wasted_rate = (stats.loop_wasted - lastwasted) / elapsed;
+    }
+    last = now;
+    lastevents = stats.loop_events;
+    lastwasted = stats.loop_wasted;
+}
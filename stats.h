@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+
+// daemon-wide counters, reported to clients by the "stats" builtin
+typedef struct unsh_stats {
+    unsigned long pathcache_hits;
+    unsigned long pathcache_misses;
+    unsigned long pathcache_invalidations;
+    unsigned long pipe_grows;
+    // output of compressed sessions, before and after deflate, and sent as is
+    unsigned long compress_in;
+    unsigned long compress_out;
+    unsigned long compress_bypassed;
+    unsigned long compress_ns;
+    // file contents moved by "get" and "put"
+    unsigned long xfer_sent;
+    unsigned long xfer_received;
+    // pipelines run in their own cgroup, and their CPU time
+    unsigned long cgroup_jobs;
+    unsigned long long cgroup_cpu_us;
+    // allocated unsh_socket structures, to catch leaks along with the RSS and fd count
+    unsigned long sockets_live;
+    // event loop: epoll_wait rounds, events and requeued turns served, and turns that found nothing to do
+    unsigned long loop_rounds;
+    unsigned long loop_events;
+    unsigned long loop_requeued;
+    unsigned long loop_wasted;
+    // current epoll_wait batch size
+    int loop_batch;
+    // per second, over the last second or so
+    double loop_events_rate;
+    double loop_wasted_rate;
+} unsh_stats;
+
+extern unsh_stats stats;
+
+size_t stats_format(char *buf, size_t size);
+// snprintf for more "stats" lines, returns the length written, which stays under size
+size_t stats_printf(char *buf, size_t size, const char *fmt, ...);
+// called once per event loop round, updates the rates
+void stats_loop_tick(void);
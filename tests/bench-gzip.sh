@@ -0,0 +1,28 @@
+#!/bin/sh
+# throughput of a cat | gzip | cat pipeline run by unshd, against the same pipeline run locally
+. "$(dirname "$0")/common.sh"
+start_unshd
+size=$((64 * 1024 * 1024))
+# compressible enough for gzip to keep up
+seq 1 20000000 | head -c $size > "$tmp/in"
+
+start=$(now)
+cat "$tmp/in" | gzip -1 | cat > "$tmp/local.gz"
+echo "local:  $(rate $size $start)"
+want=$(stat -c %s "$tmp/local.gz")
+
+# the interactive client, fed from a fifo kept open until the whole output is in
+mkfifo "$tmp/cmd"
+"$top/unsh" localhost < "$tmp/cmd" > "$tmp/remote.gz" 2> /dev/null &
+client=$!
+exec 3> "$tmp/cmd"
+start=$(now)
+echo "cat $tmp/in | gzip -1 | cat" >&3
+while [ "$(stat -c %s "$tmp/remote.gz")" -lt "$want" ]; do
+    kill -0 $client 2> /dev/null || fail "client exited"
+    sleep 0.01
+done
+echo "unshd:  $(rate $size $start)"
+exec 3>&-
+kill $client 2> /dev/null
+cmp -s "$tmp/remote.gz" "$tmp/local.gz" || fail "output differs"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# readcmd() parsing rate over the corpus of tests/readcmd.sh, in the same setting
+set -e
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/dir"
+touch "$tmp/dir/a.c" "$tmp/dir/b.c" "$tmp/dir/a1" "$tmp/dir/a2" "$tmp/dir/a b"
+cd "$tmp/dir"
+
+export ONE=1 SPACED='  two  words ' GLOBBY='*.c'
+unset UNSET
+
+echo "all lines:     $("$top/tests/splitwords" -n 20000 < "$top/tests/words.txt")"
+# globbing reads directories, the rest is plain parsing
+grep -v '[*?[]' "$top/tests/words.txt" > "$tmp/noglob"
+echo "without globs: $("$top/tests/splitwords" -n 20000 < "$tmp/noglob")"
@@ -0,0 +1,22 @@
+#!/bin/sh
+# throughput of get and put against copying the file with cat through a pipeline
+. "$(dirname "$0")/common.sh"
+start_unshd
+size=$((256 * 1024 * 1024))
+head -c $size /dev/urandom > "$tmp/in"
+mkdir "$tmp/out"
+
+start=$(now)
+"$top/unsh" -o files -d "$tmp/out" -c "cat $tmp/in" localhost > /dev/null 2>&1 || fail "cat failed"
+echo "cat:  $(rate $size $start)"
+cmp -s "$tmp/out/localhost" "$tmp/in" || fail "cat output differs"
+
+start=$(now)
+"$top/unsh" -G localhost "$tmp/in" "$tmp/got" > /dev/null 2>&1 || fail "get failed"
+echo "get:  $(rate $size $start)"
+cmp -s "$tmp/got" "$tmp/in" || fail "get output differs"
+
+start=$(now)
+"$top/unsh" -P localhost "$tmp/in" "$tmp/put" > /dev/null 2>&1 || fail "put failed"
+echo "put:  $(rate $size $start)"
+cmp -s "$tmp/put" "$tmp/in" || fail "put output differs"
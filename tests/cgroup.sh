@@ -0,0 +1,37 @@
+#!/bin/sh
+# the limit builtin and pipelines, without cgroups and with unshd -g
+. "$(dirname "$0")/common.sh"
+start_unshd
+
+status() {
+    "$top/unsh" -c "$1" localhost > /dev/null 2>&1
+}
+
+[ "$(run "echo ok")" = ok ] || fail "pipelines do not run"
+run stats | grep -q '^cgroup.enabled 0$' || fail "cgroups in use without -g"
+
+for bad in "cpu.weight max" "cpu.weight 0" "cpu.weight 10001" "pids.max -1" "memory.max 1x" "nosuch.max 1"; do
+    status "limit $bad" && fail "limit $bad was accepted"
+done
+for good in "cpu.weight 50" "pids.max 64" "memory.max max"; do
+    status "limit $good" || fail "limit $good was refused"
+done
+# limits are per session, each unsh -c is a new one
+[ "$(run "limit" | head -n 1)" = "cpu.weight 100" ] || fail "limits leaked between sessions"
+
+kill $unshd_pid
+wait $unshd_pid
+unshd_pid=
+start_unshd -g
+[ "$(run "seq 1 1000 | wc -l")" = 1000 ] || fail "pipelines do not run with -g"
+enabled=$(run stats | awk '$1 == "cgroup.enabled" { print $2 }')
+root=$(awk '$9 == "cgroup2" { print $5; exit }' /proc/self/mountinfo)
+kill $unshd_pid
+wait $unshd_pid
+unshd_pid=
+# without a writable hierarchy -g only logs why
+if [ "$enabled" = 1 ]; then
+    [ -e "$root/unshd-jobs" ] && fail "unshd-jobs left behind"
+    [ -e "$root/unshd-daemon" ] && fail "unshd-daemon left behind"
+fi
+echo "cgroup: ok, cgroup.enabled $enabled with -g"
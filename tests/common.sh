@@ -0,0 +1,56 @@
+# sourced by the tests that need a running unshd, on the default port
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+unshd_pid=
+
+cleanup() {
+    if [ -n "$unshd_pid" ]; then
+        kill "$unshd_pid" 2>/dev/null
+        wait "$unshd_pid" 2>/dev/null
+    fi
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+# so that an interrupted test still stops its unshd
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "$0: $*" >&2
+    exit 1
+}
+
+# UNSH_PORT (25252) listening, as /proc/net/tcp shows it
+listening() {
+    awk '$2 ~ /:62A4$/ && $4 == "0A" { found = 1 } END { exit !found }' /proc/net/tcp
+}
+
+start_unshd() {
+    listening && fail "port 25252 is already in use"
+    # relative paths of the commands end up in $tmp
+    (cd "$tmp" && exec "$top/unshd" "$@") > "$tmp/unshd.log" 2>&1 &
+    unshd_pid=$!
+    for i in $(seq 50); do
+        if listening; then
+            return 0
+        fi
+        kill -0 "$unshd_pid" 2>/dev/null || break
+        sleep 0.1
+    done
+    cat "$tmp/unshd.log" >&2
+    fail "unshd did not start"
+}
+
+# output of a command run through unsh, without the host prefix
+run() {
+    "$top/unsh" -c "$1" localhost 2> /dev/null | sed -n 's/^localhost: //p'
+}
+
+now() {
+    date +%s.%N
+}
+
+# MB/s for $1 bytes since $2
+rate() {
+    awk -v bytes="$1" -v start="$2" -v end="$(now)" 'BEGIN { printf "%.1f MB/s", bytes / 1048576 / (end - start) }'
+}
+
@@ -0,0 +1,43 @@
+#!/bin/sh
+# a SIGHUP restart keeps accepting, and the old unshd finishes its sessions before it exits
+. "$(dirname "$0")/common.sh"
+start_unshd
+old=$unshd_pid
+
+# a session in flight across the restart
+"$top/unsh" -c "sleep 1" localhost > /dev/null 2>&1 &
+inflight=$!
+sleep 0.2
+
+kill -HUP $old
+# connections keep being accepted, by either process
+for i in $(seq 20); do
+    [ "$(run "echo $i")" = "$i" ] || fail "command $i failed during the restart"
+done
+
+new=
+for i in $(seq 50); do
+    new=$(pgrep -P $old -x unshd) && break
+    sleep 0.1
+done
+[ -n "$new" ] || fail "no new unshd"
+grep -q "handed over" "$tmp/unshd.log" || fail "listeners were not handed over"
+
+wait $inflight || fail "the session in flight failed"
+for i in $(seq 50); do
+    kill -0 $old 2> /dev/null || break
+    sleep 0.1
+done
+kill -0 $old 2> /dev/null && fail "old unshd still running with no sessions"
+wait $old
+unshd_pid=$new
+
+[ "$(run "echo after")" = after ] || fail "new unshd does not serve"
+# not our child, so cleanup could not wait for it to let go of the port
+kill $new
+unshd_pid=
+for i in $(seq 50); do
+    listening || break
+    sleep 0.1
+done
+echo "handoff: ok"
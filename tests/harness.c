@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "harness.h"
+
+typedef struct harness_cmd {
+    char *out;
+    size_t outsize;
+    size_t outlen;
+    bool done;
+    int status;
+    int error;
+} harness_cmd;
+
+static uint64_t rng_state;
+
+static void run_output(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    harness_cmd *hc = arg;
+    // room is kept for the terminating null
+    size_t room = hc->outsize ? hc->outsize - 1 - hc->outlen : 0;
+    size_t n = len < room ? len : room;
+    memcpy(hc->out + hc->outlen, data, n);
+    hc->outlen += n;
+}
+
+static void run_done(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    harness_cmd *hc = arg;
+    hc->done = true;
+    hc->status = status;
+    hc->error = error;
+}
+
+int harness_run(unsh_client *cl, const char *host, const char *command, char *out, size_t outsize) {
+    harness_cmd hc = {out, outsize, 0, false, 0, 0};
+    unsh_cmd *cmd = unsh_submit(cl, host, command, run_output, run_done, &hc);
+    if (!cmd) {
+        return -1;
+    }
+    unsh_cmd_close_input(cmd);
+    while (!hc.done) {
+        if (unsh_client_process(cl, -1) < 0) {
+            return -1;
+        }
+    }
+    if (outsize) {
+        out[hc.outlen] = 0;
+    }
+    if (hc.error) {
+        errno = hc.error;
+        return -1;
+    }
+    return hc.status;
+}
+
+long harness_stat(unsh_client *cl, const char *host, const char *name) {
+    static char out[UNSH_BUFSIZE];
+    if (harness_run(cl, host, "stats", out, sizeof(out)) != 0) {
+        return -1;
+    }
+    size_t len = strlen(name);
+    for (char *line = out; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (!strncmp(line, name, len) && line[len] == ' ') {
+            return strtol(line + len + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+void harness_seed(uint64_t seed) {
+    rng_state = seed;
+}
+
+uint64_t harness_rand(uint64_t bound) {
+    // splitmix64, as in slowpipe
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return bound ? z % bound : z;
+}
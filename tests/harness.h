@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../libunsh.h"
+
+// helpers of the test drivers, which talk to an unshd started by tests/common.sh
+
+// run command and wait for it, keeping the start of its output in out
+// returns its exit status, or -1 with errno set if it was lost
+int harness_run(unsh_client *cl, const char *host, const char *command, char *out, size_t outsize);
+// a value from the "stats" builtin, or -1 if it is missing
+long harness_stat(unsh_client *cl, const char *host, const char *name);
+// seeded generator, the same sequence for the same seed on every libc
+void harness_seed(uint64_t seed);
+uint64_t harness_rand(uint64_t bound);
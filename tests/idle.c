@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../config.h"
+
+// opens idle connections to unshd and checks what each costs it in rss
+// unshd is looked at through /proc, so that the test does not disturb it
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, ms % 1000 * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static long count_fds(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    long n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] != '.') {
+            n++;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+static long rss_kb(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long ret = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmRSS:", 6)) {
+            ret = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// waits until unshd has accepted or dropped the connections, returns its fd count
+static long wait_fds(long pid, long want) {
+    long fds = -1;
+    for (int i = 0; i < 100 && fds != want; i++) {
+        fds = count_fds(pid);
+        if (fds != want) {
+            sleep_ms(50);
+        }
+    }
+    return fds;
+}
+
+// fd count once unshd is done starting, it listens before it opens the rest
+static long settled_fds(long pid) {
+    long fds = count_fds(pid);
+    for (int i = 0; i < 50; i++) {
+        sleep_ms(100);
+        long now = count_fds(pid);
+        if (now == fds) {
+            break;
+        }
+        fds = now;
+    }
+    return fds;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s UNSHD_PID [CONNECTIONS [BYTES]]\n", argv[0]);
+        return 1;
+    }
+    long pid = atol(argv[1]);
+    long nconns = argc > 2 ? atol(argv[2]) : 1000;
+    // bytes of rss per idle connection
+    long budget = argc > 3 ? atol(argv[3]) : 512;
+
+    long base = settled_fds(pid);
+    long rss = rss_kb(pid);
+    if (base < 0 || rss < 0) {
+        fprintf(stderr, "cannot look at unshd %ld\n", pid);
+        return 1;
+    }
+
+    int *fds = malloc(nconns * sizeof(int));
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(UNSH_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (long i = 0; i < nconns; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            perror("cannot connect");
+            return 1;
+        }
+    }
+    long got = wait_fds(pid, base + nconns);
+    if (got != base + nconns) {
+        fprintf(stderr, "unshd did not accept %ld connections, %ld fds\n", nconns, got - base);
+        return 1;
+    }
+    long idlerss = rss_kb(pid);
+    long perconn = (idlerss - rss) * 1024 / nconns;
+    printf("%ld idle connections: rss %ld -> %ld kB, %ld bytes each, budget %ld\n", nconns, rss, idlerss, perconn, budget);
+
+    for (long i = 0; i < nconns; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    long left = wait_fds(pid, base);
+    if (left != base) {
+        fprintf(stderr, "%ld fds left after closing the connections\n", left - base);
+        return 1;
+    }
+    return perconn > budget;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+# rss of unshd per idle connection, arguments go to tests/idle after the pid
+. "$(dirname "$0")/common.sh"
+start_unshd
+"$top/tests/idle" "$unshd_pid" "$@" || fail "idle connections cost too much"
@@ -0,0 +1,48 @@
+#!/bin/sh
+# the path cache must not keep commands as missing after a failed redirection, or once their PATH directory appears
+. "$(dirname "$0")/common.sh"
+start_unshd
+
+printf 'b\na\n' > "$tmp/in"
+run "sort < $tmp/nonexistent" > /dev/null
+[ "$(run "sort $tmp/in" | tr '\n' ' ')" = "a b " ] || fail "sort not found after a failed redirection"
+echo "pathcache: ok"
+
+# a PATH directory missing at startup is watched for, and again once it is removed
+kill $unshd_pid
+wait $unshd_pid
+unshd_pid=
+path=$PATH
+PATH=$tmp/pdir:$PATH
+start_unshd
+PATH=$path
+
+# events may be handled a round after the command that follows them
+eventually() {
+    for i in $(seq 20); do
+        [ "$(run "$1")" = "$2" ] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# moved in whole, so that no lookup sees it half written
+script() {
+    printf '#!/bin/sh\necho %s\n' "$2" > "$tmp/$1"
+    chmod +x "$tmp/$1"
+    mv "$tmp/$1" "$tmp/pdir/$1"
+}
+
+"$top/unsh" -c hello_unsh localhost > /dev/null 2>&1 && fail "hello_unsh found before it exists"
+[ "$(run uname)" = Linux ] || fail "uname not found"
+mkdir "$tmp/pdir"
+script hello_unsh hello
+eventually hello_unsh hello || fail "not found in a PATH directory created later"
+script uname shadowed
+eventually uname shadowed || fail "a PATH directory created later does not shadow the next ones"
+rm -r "$tmp/pdir"
+eventually uname Linux || fail "still found in a removed PATH directory"
+mkdir "$tmp/pdir"
+script hello_unsh again
+eventually hello_unsh again || fail "not found in a PATH directory created again"
+echo "pathcache: missing PATH directories ok"
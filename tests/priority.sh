@@ -0,0 +1,61 @@
+#!/bin/sh
+# the priority builtin, and interactive latency next to a batch session
+. "$(dirname "$0")/common.sh"
+start_unshd
+
+elapsed() {
+    awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.3f", end - start }'
+}
+
+[ "$(run "priority")" = interactive ] || fail "sessions do not start interactive"
+"$top/unsh" -c "priority bulk" localhost > /dev/null 2>&1 && fail "priority bulk was accepted"
+run stats | grep -q '^session.priority interactive$' || fail "no session.priority in stats"
+
+# lines sent while a command runs are its input, so each waits for the one before
+mkfifo "$tmp/jobs"
+"$top/unsh" localhost < "$tmp/jobs" > "$tmp/jobs.out" 2> /dev/null &
+jobsclient=$!
+exec 4> "$tmp/jobs"
+for line in "priority batch" "sleep 2 &" "jobs" "stats"; do
+    echo "$line" >&4
+    sleep 0.3
+done
+exec 4>&-
+kill $jobsclient 2> /dev/null
+grep -q '^\[1\] [0-9]* Running batch	' "$tmp/jobs.out" || fail "jobs does not show the batch job: $(cat "$tmp/jobs.out")"
+grep -q '^session.priority batch$' "$tmp/jobs.out" || fail "stats does not show the batch session"
+
+# a batch session, fed from a fifo kept open until its pipeline is done
+mkfifo "$tmp/cmd"
+"$top/unsh" localhost < "$tmp/cmd" > "$tmp/batch" 2> /dev/null &
+client=$!
+exec 3> "$tmp/cmd"
+echo "priority batch" >&3
+sleep 0.5
+echo "priority" >&3
+for i in $(seq 50); do
+    [ -s "$tmp/batch" ] && break
+    sleep 0.1
+done
+[ "$(cat "$tmp/batch")" = batch ] || fail "priority batch was not taken"
+echo "cat /dev/zero | head -c 4096m | wc -c" >&3
+sleep 0.2
+
+# interactive echoes while the batch pipeline runs
+worst=0
+for i in $(seq 10); do
+    start=$(now)
+    [ "$(run "echo $i")" = $i ] || fail "echo $i failed"
+    worst=$(awk -v t="$(elapsed $start)" -v w=$worst 'BEGIN { print (t > w ? t : w) }')
+done
+[ "$(wc -l < "$tmp/batch")" = 1 ] || fail "the batch pipeline was over before the echoes: $(cat "$tmp/batch")"
+for i in $(seq 600); do
+    [ "$(wc -l < "$tmp/batch")" = 2 ] && break
+    kill -0 $client 2> /dev/null || fail "client exited"
+    sleep 0.1
+done
+exec 3>&-
+kill $client 2> /dev/null
+[ "$(sed -n 2p "$tmp/batch")" = 4294967296 ] || fail "batch pipeline: $(sed -n 2p "$tmp/batch")"
+echo "priority: echo answered within ${worst}s next to a batch pipeline"
+awk -v t=$worst 'BEGIN { exit !(t < 0.5) }' || fail "echo took ${worst}s"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# compare readcmd word splitting with /bin/sh on the corpus in words.txt
+set -e
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/dir"
+touch "$tmp/dir/a.c" "$tmp/dir/b.c" "$tmp/dir/a1" "$tmp/dir/a2" "$tmp/dir/a b"
+cd "$tmp/dir"
+
+export ONE=1 SPACED='  two  words ' GLOBBY='*.c'
+unset UNSET
+
+"$top/tests/splitwords" < "$top/tests/words.txt" > "$tmp/got"
+while IFS= read -r line; do
+    # sh exits on a line it rejects, and prints nothing for no words
+    if words=$(LINE=$line /bin/sh -c 'set --; eval "set -- $LINE"; for w; do printf "[%s]\n" "$w"; done' 2> /dev/null); then
+        [ -z "$words" ] || printf '%s\n' "$words"
+    else
+        echo error
+    fi
+    echo --
+done < "$top/tests/words.txt" > "$tmp/want"
+
+diff -u "$tmp/want" "$tmp/got"
+echo "readcmd: $(grep -c . "$top/tests/words.txt") lines ok"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# a recorded session replayed at full speed against a fresh unshd
+. "$(dirname "$0")/common.sh"
+start_unshd -r "$tmp/rec"
+# sessions replay side by side, so no command reads what another writes
+seq 1 100 > "$tmp/in.txt"
+
+cat > "$tmp/cmds" <<'CMDS'
+seq 1 1000 | grep 7 | wc -l
+seq 1 100 > out.txt
+cat < in.txt
+echo "it's"
+CMDS
+while read -r line; do
+    "$top/unsh" -c "$line" localhost > /dev/null 2>&1 || fail "$line failed"
+done < "$tmp/cmds"
+kill $unshd_pid
+wait $unshd_pid
+unshd_pid=
+
+start_unshd
+"$top/unshreplay" -m -v localhost "$tmp/rec" > "$tmp/replay" || fail "replay failed"
+# -v lists the commands as recorded, with every word quoted again
+cat > "$tmp/want" <<'CMDS'
+'seq' '1' '1000' | 'grep' '7' | 'wc' '-l'
+'seq' '1' '100' > 'out.txt'
+'cat' < 'in.txt'
+'echo' 'it'\''s'
+CMDS
+sed -n 's/^ *[0-9.]\{1,\} \{1,\}[0-9.]\{1,\}  //p' "$tmp/replay" | cmp -s - "$tmp/want" || fail "other commands replayed: $(cat "$tmp/replay")"
+grep -q "^4 sessions, 4 commands, 0 lost, 0 with another exit status$" "$tmp/replay" || fail "$(head -n 1 "$tmp/replay")"
+bytes=$(sed -n 's/^output bytes: //p' "$tmp/replay")
+echo "$bytes" | awk '{ exit !($2 == $4 "," && $2 > 0) }' || fail "output bytes: $bytes"
+echo "record: 4 commands replayed, output bytes $bytes"
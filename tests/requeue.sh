@@ -0,0 +1,26 @@
+#!/bin/sh
+# a session streaming past UNSH_RELAY_BUDGET does not hold up the others, and loses nothing
+. "$(dirname "$0")/common.sh"
+start_unshd
+
+elapsed() {
+    awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.3f", end - start }'
+}
+
+size=$((64 * 1024 * 1024))
+# 16 byte lines, so that the prefix comes off every one of them
+"$top/unsh" -c "yes 0123456789abcde | head -c $size" localhost 2> /dev/null | sed 's/^localhost: //' | wc -c > "$tmp/count" &
+bulk=$!
+sleep 0.2
+
+worst=0
+for i in $(seq 20); do
+    start=$(now)
+    [ "$(run "echo $i")" = $i ] || fail "echo $i failed"
+    worst=$(awk -v t="$(elapsed $start)" -v w=$worst 'BEGIN { print (t > w ? t : w) }')
+done
+[ -s "$tmp/count" ] && fail "the stream was over before the echoes"
+wait $bulk
+[ "$(cat "$tmp/count")" = $size ] || fail "streamed $(cat "$tmp/count") of $size bytes"
+echo "requeue: $size bytes streamed, echo answered within ${worst}s meanwhile"
+awk -v t=$worst 'BEGIN { exit !(t < 0.5) }' || fail "echo took ${worst}s"
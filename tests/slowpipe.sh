@@ -0,0 +1,44 @@
+#!/bin/sh
+# flow control with slowpipe as a slow producer in a pipeline and as a slow client-side consumer
+. "$(dirname "$0")/common.sh"
+start_unshd
+
+elapsed() {
+    awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.2f", end - start }'
+}
+
+# slow producer: the rate is kept end to end, and nothing is lost
+start=$(now)
+n=$(run "head -c 64k /dev/zero | $top/slowpipe -r 32k -c 4k | wc -c")
+t=$(elapsed $start)
+[ "$n" = 65536 ] || fail "slow producer: got $n bytes"
+awk -v t=$t 'BEGIN { exit !(t >= 1.7 && t < 5) }' || fail "slow producer: 64k at 32k/s took ${t}s"
+echo "slow producer: 64k in ${t}s"
+
+# stalls and jitter, seeded, do not reorder or drop anything
+want=$(seq 1 20000 | md5sum)
+got=$(run "seq 1 20000 | $top/slowpipe -r 0 -c 1k -j 2 -s 16k:50 -S 7 | md5sum")
+[ "$got" = "$want" ] || fail "stalls: output differs"
+echo "stalls: ok"
+
+# slow consumer: unshd stops reading the pipeline instead of buffering its output
+mkdir "$tmp/out"
+mkfifo "$tmp/out/localhost"
+"$top/slowpipe" -r 16m -c 64k -n < "$tmp/out/localhost" &
+sink=$!
+rss=$(run stats | awk '$1 == "process.rss_kb" { print $2 }')
+start=$(now)
+"$top/unsh" -o files -d "$tmp/out" -c "head -c 64m /dev/zero" localhost > /dev/null 2>&1 &
+client=$!
+sleep 1
+# the event loop keeps serving other sessions meanwhile
+probe=$(now)
+peak=$(run stats | awk '$1 == "process.rss_kb" { print $2 }')
+latency=$(elapsed $probe)
+wait $client || fail "slow consumer: command failed"
+wait $sink
+t=$(elapsed $start)
+echo "slow consumer: 64m in ${t}s, rss $rss -> $peak kB, stats answered in ${latency}s"
+awk -v t=$t 'BEGIN { exit !(t >= 3) }' || fail "slow consumer: the 16m/s sink was not waited for"
+[ $((peak - rss)) -lt 8192 ] || fail "slow consumer: unshd buffered $((peak - rss)) kB"
+awk -v t=$latency 'BEGIN { exit !(t < 0.5) }' || fail "slow consumer: stats took ${latency}s"
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "harness.h"
+
+// drives unshd with a seeded mix of commands, failures, disconnects and garbage,
+// samples its rss, fds and live sockets after each round, and fails if they trend upward
+
+#define HOST "localhost"
+#define NSAMPLED 3
+
+// stats sampled after each round, and the growth allowed for each over the measured rounds
+static const char *const sampled[NSAMPLED] = {"sockets.live", "process.fds", "process.rss_kb"};
+static const double maxgrowth[NSAMPLED] = {1, 1, 512};
+
+static const char *const commands[] = {
+    // fine
+    "echo hello",
+    "seq 1 2000 | sort -r | head -n 3",
+    "cat < /etc/passwd | wc -l",
+    "stats",
+    "jobs",
+    "sleep 0.01 &",
+    "export SOAK=1",
+    "env | grep -c PATH",
+    // failing
+    "false",
+    "soak-no-such-command",
+    "cat < /soak/nonexistent",
+    "echo x > /soak/nonexistent/file",
+    "kill %42",
+    "limit cpu.weight 0",
+    // malformed
+    "echo \"unterminated",
+    "| cat",
+    "echo ${",
+    "cat <",
+    "echo a & &",
+    "\"\" x",
+};
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, ms % 1000 * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static void output_ignored(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    (void)data;
+    (void)len;
+    (void)arg;
+}
+
+static void done_ignored(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    (void)status;
+    (void)error;
+    (void)arg;
+}
+
+// a session that goes away in the middle of its command
+static void disconnect(void) {
+    static const char *const pending[] = {"cat", "sleep 0.2", "seq 1 1000000", "cat | cat | cat"};
+    unsh_client *dc = unsh_client_new();
+    const char *command = pending[harness_rand(sizeof(pending) / sizeof(pending[0]))];
+    unsh_cmd *cmd = unsh_submit(dc, HOST, command, output_ignored, done_ignored, NULL);
+    if (cmd && harness_rand(2)) {
+        unsh_cmd_write(cmd, "some input\n", 11);
+    }
+    for (long i = harness_rand(4); i > 0; i--) {
+        unsh_client_process(dc, 5);
+    }
+    unsh_client_free(dc);
+}
+
+// a raw connection sending random bytes, overlong lines included
+// as one line naming a command that does not exist, no redirections or jobs
+static void garbage(void) {
+    static const char prefix[] = "framed\nsoak-garbage ";
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(UNSH_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        perror("cannot connect");
+        exit(1);
+    }
+    char buf[2 * UNSH_LINE_MAX];
+    // random frames after the switch to framed mode, or a random line
+    size_t start = harness_rand(2) ? 0 : strlen("framed\n");
+    size_t len = strlen(prefix) + harness_rand(sizeof(buf) - strlen(prefix));
+    memcpy(buf, prefix, strlen(prefix));
+    for (size_t i = strlen(prefix); i < len; i++) {
+        buf[i] = harness_rand(256);
+        if (strchr("\n<>|&", buf[i])) {
+            buf[i] = ' ';
+        }
+    }
+    buf[len++] = '\n';
+    if (write(fd, buf + start, len - start) < 0) {
+        perror("cannot write");
+    }
+    close(fd);
+}
+
+// the sessions and jobs of the round go away on their own, wait until the counts settle
+static void settle(unsh_client *cl, double *sample) {
+    double last[NSAMPLED] = {-1, -1, -1};
+    int stable = 0;
+    for (int i = 0; i < 50 && stable < 3; i++) {
+        sleep_ms(100);
+        for (int j = 0; j < NSAMPLED; j++) {
+            sample[j] = harness_stat(cl, HOST, sampled[j]);
+            if (sample[j] < 0) {
+                fprintf(stderr, "cannot read %s\n", sampled[j]);
+                exit(1);
+            }
+        }
+        // rss is left out, freed memory is not always given back
+        stable = sample[0] == last[0] && sample[1] == last[1] ? stable + 1 : 0;
+        memcpy(last, sample, sizeof(last));
+    }
+}
+
+// growth over the samples, from the slope of their least squares line
+static double trend(const double *samples, size_t n) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 0; i < n; i++) {
+        double y = samples[i * NSAMPLED];
+        sx += i;
+        sy += y;
+        sxx += (double)i * i;
+        sxy += i * y;
+    }
+    double den = n * sxx - sx * sx;
+    return den ? (n * sxy - sx * sy) / den * (n - 1) : 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long long seed = 1;
+    unsigned rounds = 20, actions = 50;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                actions = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s SEED] [-r ROUNDS] [-n ACTIONS]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 4) {
+        fprintf(stderr, "at least 4 rounds are needed for a trend\n");
+        return 1;
+    }
+    harness_seed(seed);
+
+    unsh_client *cl = unsh_client_new();
+    // NSAMPLED values per round
+    double *samples = calloc(rounds, NSAMPLED * sizeof(double));
+    for (unsigned r = 0; r < rounds; r++) {
+        // a few commands at once on a client of their own, some of them with input
+        unsh_client *wc = unsh_client_new();
+        for (unsigned a = 0; a < actions; a++) {
+            unsigned kind = harness_rand(10);
+            if (kind < 6) {
+                const char *command = commands[harness_rand(sizeof(commands) / sizeof(commands[0]))];
+                unsh_cmd *cmd = unsh_submit(wc, HOST, command, output_ignored, done_ignored, NULL);
+                if (cmd) {
+                    unsh_cmd_close_input(cmd);
+                }
+            } else if (kind < 7) {
+                unsh_cmd *cmd = unsh_submit(wc, HOST, "wc -c", output_ignored, done_ignored, NULL);
+                if (cmd) {
+                    unsh_cmd_write(cmd, commands, harness_rand(sizeof(commands)));
+                    unsh_cmd_close_input(cmd);
+                }
+            } else if (kind < 9) {
+                disconnect();
+            } else {
+                garbage();
+            }
+            while (unsh_client_pending(wc) >= 8) {
+                unsh_client_process(wc, -1);
+            }
+        }
+        while (unsh_client_pending(wc)) {
+            unsh_client_process(wc, -1);
+        }
+        unsh_client_free(wc);
+
+        double *sample = samples + r * NSAMPLED;
+        settle(cl, sample);
+        printf("round %u:", r);
+        for (int j = 0; j < NSAMPLED; j++) {
+            printf(" %s %.0f", sampled[j], sample[j]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // allocator and pool warm-up is not a leak
+    size_t warm = rounds / 4;
+    int ret = 0;
+    printf("seed %llu, %u rounds of %u, growth:", seed, rounds, actions);
+    for (int j = 0; j < NSAMPLED; j++) {
+        double growth = trend(samples + warm * NSAMPLED + j, rounds - warm);
+        printf(" %s %.1f", sampled[j], growth);
+        if (growth > maxgrowth[j]) {
+            ret = 1;
+        }
+    }
+    printf("\n");
+    free(samples);
+    unsh_client_free(cl);
+    if (ret) {
+        fprintf(stderr, "resources trend upward, replay with -s %llu\n", seed);
+    }
+    return ret;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+# soak unshd, arguments go to tests/soak, see there
+. "$(dirname "$0")/common.sh"
+start_unshd
+"$top/tests/soak" "$@" || fail "soak failed"
@@ -0,0 +1,86 @@
+// prints the words readcmd() makes of each line on stdin, one per line in
+// brackets and followed by "--", the format tests/readcmd.sh expects
+// with -n N, parses the lines N times over and prints lines per second instead
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../readcmd.h"
+
+extern char **environ;
+
+static void print_words(struct cmdline *cmd) {
+    if (cmd->err) {
+        printf("error\n");
+        return;
+    }
+    for (char ***seq = cmd->seq; *seq; seq++) {
+        if (seq != cmd->seq) {
+            printf("|\n");
+        }
+        for (char **w = *seq; *w; w++) {
+            printf("[%s]\n", *w);
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    long rounds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n ROUNDS] < LINES\n", argv[0]);
+                return 1;
+        }
+    }
+
+    char **lines = NULL;
+    size_t nlines = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = 0;
+        }
+        lines = realloc(lines, (nlines + 1) * sizeof(char *));
+        lines[nlines++] = strdup(line);
+    }
+    free(line);
+
+    if (!rounds) {
+        for (size_t i = 0; i < nlines; i++) {
+            print_words(readcmd(lines[i], environ));
+            printf("--\n");
+        }
+    } else {
+        double start = now();
+        for (long r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < nlines; i++) {
+                readcmd(lines[i], environ);
+            }
+        }
+        printf("%.0f lines/s\n", rounds * nlines / (now() - start));
+    }
+
+    readcmd(NULL, NULL);
+    for (size_t i = 0; i < nlines; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+
+const char *const unsh_trace_names[TRACE_MAX] = {
+    "wait",
+    "batch",
+    "client_read",
+    "client_write",
+    "parse",
+    "spawn",
+    "lookup",
+    "fork",
+    "proc_out_read",
+    "sigchld",
+    "reap",
+    "offload",
+};
+
+#ifdef UNSH_TRACE
+
+// written by its own thread only, the last UNSH_TRACE_RING events are kept
+typedef struct unsh_trace_ring {
+    struct unsh_trace_ring *next;
+    uint32_t tid;
+    // events written so far, published after each event
+    uint64_t head;
+    unsh_trace_event events[UNSH_TRACE_RING];
+} unsh_trace_ring;
+
+// rings of every thread that recorded something, only ever pushed to
+static unsh_trace_ring *rings;
+static __thread unsh_trace_ring *ring;
+
+static unsh_trace_ring *ring_new(void) {
+    unsh_trace_ring *r = calloc(1, sizeof(unsh_trace_ring));
+    if (!r) {
+        return NULL;
+    }
+    r->tid = syscall(SYS_gettid);
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return r;
+}
+
+void trace_record(unsh_tracepoint point, char phase, uint32_t arg) {
+    if (!ring && !(ring = ring_new())) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t head = ring->head;
+    unsh_trace_event *ev = &ring->events[head & (UNSH_TRACE_RING - 1)];
+    ev->ts = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    ev->arg = arg;
+    ev->point = point;
+    ev->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len) {
+        ssize_t thiswrite = write(fd, ptr, len);
+        if (thiswrite < 0) {
+            return -1;
+        }
+        ptr += thiswrite;
+        len -= thiswrite;
+    }
+    return 0;
+}
+
+// snapshot every ring to path
+// events of other threads that wrap around during the dump may come out torn
+int trace_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("cannot open trace file");
+        return -1;
+    }
+    if (write_all(fd, UNSH_TRACE_MAGIC, strlen(UNSH_TRACE_MAGIC)) < 0) {
+        goto fail;
+    }
+    for (unsh_trace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t count = head < UNSH_TRACE_RING ? head : UNSH_TRACE_RING;
+        unsh_trace_header hdr = {r->tid, count};
+        if (write_all(fd, &hdr, sizeof(hdr)) < 0) {
+            goto fail;
+        }
+        // oldest first, in two pieces if the ring has wrapped
+        size_t start = (head - count) & (UNSH_TRACE_RING - 1);
+        size_t first = count < UNSH_TRACE_RING - start ? count : UNSH_TRACE_RING - start;
+        if (write_all(fd, &r->events[start], first * sizeof(unsh_trace_event)) < 0 ||
+            write_all(fd, r->events, (count - first) * sizeof(unsh_trace_event)) < 0) {
+            goto fail;
+        }
+    }
+    close(fd);
+    return 0;
+
+fail:
+    perror("cannot write trace file");
+    close(fd);
+    return -1;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+// trace points, compiled in with "make TRACE=1" and dumped on SIGUSR2
+// when disabled the macros expand to nothing and their arguments are not evaluated
+typedef enum unsh_tracepoint {
+    // epoll_wait, end arg: number of events
+    TRACE_WAIT,
+    // one batch of events, arg: number of events
+    TRACE_BATCH,
+    // arg: client fd
+    TRACE_CLIENT_READ,
+    TRACE_CLIENT_WRITE,
+    TRACE_PARSE,
+    TRACE_SPAWN,
+    // PATH lookup of one pipeline stage
+    TRACE_LOOKUP,
+    // instant, arg: child pid
+    TRACE_FORK,
+    // arg: tail pipe fd
+    TRACE_PROC_OUT_READ,
+    TRACE_SIGCHLD,
+    // instant, arg: child pid
+    TRACE_REAP,
+    // blocking work on a helper thread
+    TRACE_OFFLOAD,
+    TRACE_MAX
+} unsh_tracepoint;
+
+// ts is CLOCK_MONOTONIC in ns, phase is 'B', 'E' or 'i' as in the Chrome trace format
+typedef struct unsh_trace_event {
+    uint64_t ts;
+    uint32_t arg;
+    uint16_t point;
+    uint8_t phase;
+    uint8_t pad;
+} unsh_trace_event;
+
+// dump file: the magic, then for each thread a header followed by its events, oldest first
+#define UNSH_TRACE_MAGIC "UNSHTRC1"
+
+typedef struct unsh_trace_header {
+    uint32_t tid;
+    uint32_t nevents;
+} unsh_trace_header;
+
+extern const char *const unsh_trace_names[TRACE_MAX];
+
+#ifdef UNSH_TRACE
+void trace_record(unsh_tracepoint point, char phase, uint32_t arg);
+int trace_dump(const char *path);
+#define UNSH_TRACE_BEGIN(point, arg) trace_record(point, 'B', arg)
+#define UNSH_TRACE_END(point, arg) trace_record(point, 'E', arg)
+#define UNSH_TRACE_INSTANT(point, arg) trace_record(point, 'i', arg)
+#else
+#define UNSH_TRACE_BEGIN(point, arg) ((void)0)
+#define UNSH_TRACE_END(point, arg) ((void)0)
+#define UNSH_TRACE_INSTANT(point, arg) ((void)0)
+#endif
@@ -1,68 +1,637 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
-#include <error.h>
 #include <fcntl.h>
-#include <netdb.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "libunsh.h"
 
-int main(int argc, char **argv) {
-    size_t namesize;
-    char *name = NULL;
 
-    if (argc == 1) {
-        printf("Enter hostname: ");
-        int nchar = getline(&name, &namesize, stdin);
-        if (nchar < 1) {
-            fprintf(stderr, "Bad name\n");
+typedef enum unsh_hoststate {
+    HOSTSTATE_PENDING,
+    HOSTSTATE_RUNNING,
+    HOSTSTATE_DONE,
+    HOSTSTATE_FAILED
+} unsh_hoststate;
+
+typedef enum unsh_outmode {
+    OUTMODE_PREFIX,
+    OUTMODE_GROUP,
+    OUTMODE_FILES
+} unsh_outmode;
+
+// a fan-out run in progress
+typedef struct unsh_fanout {
+    unsh_client *cl;
+    const char *command;
+    unsh_outmode outmode;
+    const char *outdir;
+    size_t inflight;
+    size_t finished;
+} unsh_fanout;
+
+// one target of a fan-out run
+typedef struct unsh_host {
+    char *name;
+    unsh_fanout *fo;
+    unsh_hoststate state;
+    struct timespec start;
+    double elapsed;
+    const char *error;
+    int status;
+    // prefix mode: incomplete last line, group mode: the whole output
+    char *buf;
+    size_t buflen;
+    size_t bufcap;
+    // files mode: per-host output file
+    int outfd;
+} unsh_host;
+
+static double elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void host_append(unsh_host *host, const char *data, size_t len) {
+    if (host->buflen + len > host->bufcap) {
+        host->bufcap = (host->buflen + len) * 2;
+        host->buf = realloc(host->buf, host->bufcap);
+    }
+    memcpy(host->buf + host->buflen, data, len);
+    host->buflen += len;
+}
+
+static void host_output(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    unsh_host *host = arg;
+    unsh_outmode outmode = host->fo->outmode;
+    if (outmode == OUTMODE_FILES) {
+        if (write(host->outfd, data, len) != (ssize_t)len) {
+            perror("error writing host output");
+        }
+        return;
+    }
+
+    host_append(host, data, len);
+    if (outmode == OUTMODE_PREFIX) {
+        // print complete lines only, so that hosts do not interleave mid-line
+        char *start = host->buf;
+        char *eol;
+        while ((eol = memchr(start, '\n', host->buf + host->buflen - start))) {
+            printf("%s: %.*s\n", host->name, (int)(eol - start), start);
+            start = eol + 1;
+        }
+        host->buflen -= start - host->buf;
+        memmove(host->buf, start, host->buflen);
+    }
+}
+
+static void host_finish(unsh_host *host, const char *error) {
+    unsh_fanout *fo = host->fo;
+    unsh_outmode outmode = fo->outmode;
+    host->elapsed = elapsed_ms(&host->start);
+    host->error = error;
+    host->state = error ? HOSTSTATE_FAILED : HOSTSTATE_DONE;
+    fo->inflight--;
+    fo->finished++;
+
+    if (outmode == OUTMODE_PREFIX && host->buflen) {
+        printf("%s: %.*s\n", host->name, (int)host->buflen, host->buf);
+    } else if (outmode == OUTMODE_GROUP) {
+        printf("==> %s <==\n%.*s", host->name, (int)host->buflen, host->buf);
+        if (host->buflen && host->buf[host->buflen - 1] != '\n') {
+            putchar('\n');
+        }
+    } else if (outmode == OUTMODE_FILES && host->outfd >= 0) {
+        close(host->outfd);
+        host->outfd = -1;
+    }
+    free(host->buf);
+    host->buf = NULL;
+    host->buflen = 0;
+}
+
+static void host_done(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    unsh_host *host = arg;
+    host->status = status;
+    host_finish(host, error ? strerror(error) : NULL);
+}
+
+static void host_start(unsh_host *host) {
+    unsh_fanout *fo = host->fo;
+    clock_gettime(CLOCK_MONOTONIC, &host->start);
+    host->state = HOSTSTATE_RUNNING;
+    fo->inflight++;
+
+    if (fo->outmode == OUTMODE_FILES) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", fo->outdir, host->name);
+        host->outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (host->outfd < 0) {
+            host_finish(host, strerror(errno));
+            return;
+        }
+    }
+
+    unsh_cmd *cmd = unsh_submit(fo->cl, host->name, fo->command, host_output, host_done, host);
+    if (!cmd) {
+        host_finish(host, errno == EHOSTUNREACH ? "no such domain" : strerror(errno));
+        return;
+    }
+    // no input for the command
+    unsh_cmd_close_input(cmd);
+}
+
+static void add_host(unsh_host **hosts, size_t *nhosts, const char *name) {
+    *hosts = realloc(*hosts, (*nhosts + 1) * sizeof(unsh_host));
+    unsh_host *host = &(*hosts)[(*nhosts)++];
+    memset(host, 0, sizeof(unsh_host));
+    host->name = strdup(name);
+    host->outfd = -1;
+    host->state = HOSTSTATE_PENDING;
+}
+
+static int read_hostfile(const char *path, unsh_host **hosts, size_t *nhosts) {
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!f) {
+        perror("cannot open host file");
+        return -1;
+    }
+    char *line = NULL;
+    size_t linesize = 0;
+    while (getline(&line, &linesize, f) > 0) {
+        char *name = line + strspn(line, " \t");
+        name[strcspn(name, " \t\r\n#")] = 0;
+        if (*name) {
+            add_host(hosts, nhosts, name);
+        }
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return 0;
+}
+
+// run one command on many hosts from a single event loop, at most window at a time
+static int fanout(unsh_host *hosts, size_t nhosts, const char *command, size_t window, unsh_outmode outmode, const char *outdir, bool compress) {
+    unsh_fanout fo = {0};
+    fo.command = command;
+    fo.outmode = outmode;
+    fo.outdir = outdir;
+    fo.cl = unsh_client_new();
+    if (!fo.cl) {
+        perror("error creating client");
+        return 1;
+    }
+    unsh_client_set_compress(fo.cl, compress);
+
+    size_t next = 0;
+    while (fo.finished < nhosts) {
+        while (next < nhosts && fo.inflight < window) {
+            hosts[next].fo = &fo;
+            host_start(&hosts[next++]);
+        }
+        if (!fo.inflight) {
+            continue;
+        }
+        if (unsh_client_process(fo.cl, -1) < 0) {
+            perror("error waiting for new events");
             return 1;
         }
-        name[nchar - 1] = 0; // erase the \n
+        fflush(stdout);
+    }
+
+    // latency summary
+    int failed = 0;
+    double total = 0, worst = 0;
+    for (size_t i = 0; i < nhosts; i++) {
+        unsh_host *host = &hosts[i];
+        char result[32];
+        if (host->error) {
+            snprintf(result, sizeof(result), "%s", host->error);
+        } else if (host->status) {
+            snprintf(result, sizeof(result), "exit %d", host->status);
+        } else {
+            snprintf(result, sizeof(result), "ok");
+        }
+        fprintf(stderr, "%-32s %8.1f ms  %s\n", host->name, host->elapsed, result);
+        failed += host->error || host->status;
+        total += host->elapsed;
+        worst = host->elapsed > worst ? host->elapsed : worst;
+    }
+    fprintf(stderr, "%zu hosts, %d failed, %.1f ms average, %.1f ms worst\n", nhosts, failed, total / nhosts, worst);
+
+    unsh_client_free(fo.cl);
+    return failed ? 1 : 0;
+}
+
+// a file transfer with -G or -P, through the "get" and "put" builtins
+typedef struct unsh_transfer {
+    unsh_client *cl;
+    const char *host;
+    const char *name;
+    unsh_cmd *cmd;
+    int fd;
+    // where the transfer starts in the file, and the size of the whole file
+    unsigned long long offset;
+    unsigned long long total;
+    // file contents received, or written to the command
+    unsigned long long done;
+    // output of a "size" command, or messages of a put
+    char msg[UNSH_BUFSIZE];
+    size_t msglen;
+    bool over;
+    int status;
+    int error;
+    struct timespec start;
+    double reported;
+} unsh_transfer;
+
+// single-quote a path for the unshd command line
+static char *quote(const char *path) {
+    char *ret = malloc(strlen(path) * 4 + 3);
+    char *ptr = ret;
+    *ptr++ = '\'';
+    for (; *path; path++) {
+        if (*path == '\'') {
+            ptr = stpcpy(ptr, "'\\''");
+        } else {
+            *ptr++ = *path;
+        }
+    }
+    *ptr++ = '\'';
+    *ptr = 0;
+    return ret;
+}
+
+static void transfer_progress(unsh_transfer *t, unsigned long long done, bool last) {
+    double ms = elapsed_ms(&t->start);
+    if (!last && (!isatty(2) || ms - t->reported < 200)) {
+        return;
+    }
+    t->reported = ms;
+    double rate = ms > 0 ? (done - t->offset) / ms / 1e3 : 0;
+    if (isatty(2)) {
+        fprintf(stderr, "\r%s: %llu/%llu bytes, %.1f MB/s", t->name, done, t->total, rate);
+        if (last) {
+            fputc('\n', stderr);
+        }
     } else {
-        name = argv[1];
+        fprintf(stderr, "%s: %llu/%llu bytes, %.1f MB/s\n", t->name, done, t->total, rate);
     }
+}
 
-    struct hostent *he = gethostbyname(name);
-    if (!he) {
-        printf("no such domain\n");
-        return 2;
+static void transfer_msg(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    unsh_transfer *t = arg;
+    if (len > sizeof(t->msg) - 1 - t->msglen) {
+        len = sizeof(t->msg) - 1 - t->msglen;
     }
+    memcpy(t->msg + t->msglen, data, len);
+    t->msglen += len;
+    t->msg[t->msglen] = 0;
+}
 
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(struct sockaddr_in));
-    sa.sin_family = AF_INET;
-    memcpy((char *)&sa.sin_addr.s_addr, he->h_addr_list[0], he->h_length);
-    sa.sin_port = htons(UNSH_PORT);
+static void transfer_data(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    unsh_transfer *t = arg;
+    while (len) {
+        ssize_t thiswrite = write(t->fd, data, len);
+        if (thiswrite < 0) {
+            t->error = errno;
+            return;
+        }
+        data += thiswrite;
+        len -= thiswrite;
+        t->done += thiswrite;
+    }
+    transfer_progress(t, t->offset + t->done, false);
+}
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("error creating sockfd");
+static void transfer_done(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    unsh_transfer *t = arg;
+    t->cmd = NULL;
+    t->over = true;
+    t->status = status;
+    if (error) {
+        t->error = error;
+    }
+}
+
+// run command and wait for it to be over
+static int transfer_run(unsh_transfer *t, const char *command, unsh_output_cb out_cb) {
+    t->over = false;
+    t->msglen = 0;
+    t->cmd = unsh_submit(t->cl, t->host, command, out_cb, transfer_done, t);
+    if (!t->cmd) {
+        perror("error submitting command");
+        return -1;
+    }
+    while (!t->over) {
+        if (unsh_client_process(t->cl, -1) < 0) {
+            perror("error processing events");
+            return -1;
+        }
+    }
+    if (t->error) {
+        fprintf(stderr, "%s: %s\n", t->host, strerror(t->error));
+        return -1;
+    }
+    return 0;
+}
+
+// size of the remote file, -1 if it cannot be had
+static long long transfer_size(unsh_transfer *t, const char *qremote) {
+    char command[UNSH_LINE_MAX + 1];
+    snprintf(command, sizeof(command), "size %s", qremote);
+    if (transfer_run(t, command, transfer_msg) < 0 || t->status) {
+        return -1;
+    }
+    return strtoll(t->msg, NULL, 10);
+}
+
+static int transfer_get(unsh_transfer *t, const char *remote, const char *local, bool resume) {
+    char *qremote = quote(remote);
+    long long size = transfer_size(t, qremote);
+    if (size < 0) {
+        fprintf(stderr, "%s", t->msg);
+        free(qremote);
         return 1;
     }
+    t->fd = open(local, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC) | O_CLOEXEC, 0666);
+    off_t offset = t->fd < 0 ? -1 : lseek(t->fd, 0, SEEK_END);
+    if (offset < 0) {
+        perror(local);
+        free(qremote);
+        return 1;
+    }
+    if (offset > size) {
+        fprintf(stderr, "%s: larger than %s on %s, not resuming\n", local, remote, t->host);
+        free(qremote);
+        return 1;
+    }
+    t->offset = offset;
+    t->total = size;
 
-    if (connect(sockfd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0) {
-        perror("error connecting");
+    char command[UNSH_LINE_MAX + 1];
+    snprintf(command, sizeof(command), "get %s %lld", qremote, (long long)offset);
+    free(qremote);
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    if (transfer_run(t, command, transfer_data) < 0) {
         return 1;
     }
+    if (t->status) {
+        // the file is only sent on success, anything received is an error message
+        char msg[UNSH_BUFSIZE];
+        ssize_t len = pread(t->fd, msg, t->done < sizeof(msg) ? t->done : sizeof(msg), t->offset);
+        if (len > 0) {
+            fwrite(msg, 1, len, stderr);
+        }
+        if (ftruncate(t->fd, t->offset) < 0) {
+            perror(local);
+        }
+        return 1;
+    }
+    transfer_progress(t, t->offset + t->done, true);
+    return 0;
+}
 
-    int flags = fcntl(sockfd, F_GETFD);
-    if (flags < 0) {
-        perror("error getting socket state");
+static int transfer_put(unsh_transfer *t, const char *local, const char *remote, bool resume) {
+    char *qremote = quote(remote);
+    long long offset = resume ? transfer_size(t, qremote) : 0;
+    struct stat st;
+    t->fd = open(local, O_RDONLY | O_CLOEXEC);
+    if (t->fd < 0 || fstat(t->fd, &st) < 0) {
+        perror(local);
+        free(qremote);
+        return 1;
+    }
+    if (offset < 0) {
+        // nothing to resume
+        offset = 0;
+    } else if (offset > st.st_size) {
+        fprintf(stderr, "%s on %s: larger than %s, not resuming\n", remote, t->host, local);
+        free(qremote);
+        return 1;
+    }
+    if (lseek(t->fd, offset, SEEK_SET) < 0) {
+        perror(local);
+        free(qremote);
+        return 1;
+    }
+    t->offset = offset;
+    t->total = st.st_size;
+
+    char command[UNSH_LINE_MAX + 1];
+    snprintf(command, sizeof(command), "put %s %lld", qremote, offset);
+    free(qremote);
+    t->over = false;
+    t->msglen = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    t->cmd = unsh_submit(t->cl, t->host, command, transfer_msg, transfer_done, t);
+    if (!t->cmd) {
+        perror("error submitting command");
+        return 1;
+    }
+    bool eof = false;
+    char buf[65536];
+    while (!t->over) {
+        // keep the socket busy without reading the whole file into memory
+        if (!eof && unsh_cmd_queued(t->cmd) < UNSH_XFER_WINDOW) {
+            ssize_t thisread = read(t->fd, buf, sizeof(buf));
+            if (thisread < 0) {
+                perror(local);
+                return 1;
+            } else if (thisread == 0) {
+                eof = true;
+                unsh_cmd_close_input(t->cmd);
+            } else {
+                unsh_cmd_write(t->cmd, buf, thisread);
+                t->done += thisread;
+            }
+            if (unsh_client_process(t->cl, 0) < 0) {
+                perror("error processing events");
+                return 1;
+            }
+            continue;
+        }
+        if (unsh_client_process(t->cl, 200) < 0) {
+            perror("error processing events");
+            return 1;
+        }
+        if (t->cmd) {
+            transfer_progress(t, t->offset + t->done - unsh_cmd_queued(t->cmd), false);
+        }
+    }
+    if (t->error) {
+        fprintf(stderr, "%s: %s\n", t->host, strerror(t->error));
+        return 1;
+    }
+    if (t->status) {
+        fprintf(stderr, "%s", t->msg);
+        return 1;
+    }
+    transfer_progress(t, t->offset + t->done, true);
+    return 0;
+}
+
+static int transfer(const char *host, bool get, const char *source, const char *dest, bool resume, bool compress) {
+    unsh_transfer t = {0};
+    t.host = host;
+    t.fd = -1;
+    t.cl = unsh_client_new();
+    if (!t.cl) {
+        perror("error creating client");
+        return 1;
+    }
+    unsh_client_set_compress(t.cl, compress);
+    // by default, the same name here and there
+    if (!dest) {
+        dest = get ? basename(source) : source;
+    }
+    t.name = get ? source : dest;
+    int ret = get ? transfer_get(&t, source, dest, resume) : transfer_put(&t, source, dest, resume);
+    if (t.fd >= 0) {
+        close(t.fd);
+    }
+    unsh_client_free(t.cl);
+    return ret;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [-z] [HOST]\n"
+        "       %s -c COMMAND [-z] [-p WINDOW] [-o prefix|group|files] [-d DIR] [-f HOSTFILE] [HOST...]\n"
+        "       %s -G [-z] [-C] HOST REMOTE [LOCAL]\n"
+        "       %s -P [-z] [-C] HOST LOCAL [REMOTE]\n",
+        argv0, argv0, argv0, argv0);
+}
+
+// an interactive session: one command at a time, fed from our stdin
+typedef struct unsh_session {
+    unsh_client *cl;
+    const char *host;
+    unsh_cmd *cmd;
+    char *line;
+    size_t linelen;
+    // the line being typed is over UNSH_LINE_MAX and is skipped
+    bool overlong;
+    // stdin is not polled until the command is over
+    bool stdinoff;
+    bool quit;
+    int status;
+} unsh_session;
+
+static void session_output(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    (void)arg;
+    if (write(1, data, len) < 0) {
+        perror("error writing output");
+    }
+}
+
+static void session_done(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    unsh_session *s = arg;
+    s->cmd = NULL;
+    if (error) {
+        fprintf(stderr, "%s: %s\n", s->host, strerror(error));
+        s->status = 1;
+        s->quit = true;
+    } else {
+        s->status = status;
+    }
+}
+
+static void session_submit(unsh_session *s) {
+    s->line[s->linelen] = 0;
+    s->linelen = 0;
+    s->cmd = unsh_submit(s->cl, s->host, s->line, session_output, session_done, s);
+    if (!s->cmd) {
+        perror("error submitting command");
+        s->status = 1;
+        s->quit = true;
+    }
+}
+
+// lines typed while no command runs are commands, the rest is input of the running command
+static void session_input(unsh_session *s, const char *data, size_t len) {
+    while (len && !s->quit) {
+        if (s->cmd) {
+            unsh_cmd_write(s->cmd, data, len);
+            return;
+        }
+        const char *eol = memchr(data, '\n', len);
+        size_t n = eol ? (size_t)(eol - data) : len;
+        if (s->linelen + n > UNSH_LINE_MAX) {
+            s->overlong = true;
+        } else if (!s->overlong) {
+            memcpy(s->line + s->linelen, data, n);
+            s->linelen += n;
+        }
+        if (!eol) {
+            return;
+        }
+        if (s->overlong) {
+            fprintf(stderr, "unsh: line too long\n");
+            s->overlong = false;
+            s->linelen = 0;
+        } else {
+            session_submit(s);
+        }
+        data += n + 1;
+        len -= n + 1;
+    }
+}
+
+static int interactive(char *name, bool compress) {
+    size_t namesize;
+
+    if (!name) {
+        printf("Enter hostname: ");
+        int nchar = getline(&name, &namesize, stdin);
+        if (nchar < 1) {
+            fprintf(stderr, "Bad name\n");
+            return 1;
+        }
+        name[nchar - 1] = 0; // erase the \n
+    }
+
+    unsh_session s = {0};
+    s.host = name;
+    s.line = malloc(UNSH_LINE_MAX + 1);
+    s.cl = unsh_client_new();
+    if (!s.cl) {
+        perror("error creating client");
         return 1;
     }
-    if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        perror("error setting socket state");
+    unsh_client_set_compress(s.cl, compress);
+    // exports and jobs stay around between the lines typed
+    unsh_client_set_session(s.cl, true);
+    // connect right away, the first command does not wait for the handshake
+    if (unsh_connect(s.cl, name) < 0) {
+        if (errno == EHOSTUNREACH) {
+            printf("no such domain\n");
+            return 2;
+        }
+        perror("error connecting");
         return 1;
     }
-    flags = fcntl(0, F_GETFD);
+
+    int flags = fcntl(0, F_GETFL);
     if (flags < 0) {
         perror("error getting stdin state");
         return 1;
@@ -82,9 +651,9 @@ int main(int argc, char **argv) {
 
     struct epoll_event sockopts = {0};
     sockopts.events = EPOLLIN;
-    sockopts.data.fd = sockfd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &sockopts) < 0) {
-        perror("cannot set socket epoll");
+    sockopts.data.fd = unsh_client_fd(s.cl);
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, unsh_client_fd(s.cl), &sockopts) < 0) {
+        perror("cannot set client epoll");
         return 1;
     }
     memset(&sockopts, 0, sizeof(struct epoll_event));
@@ -97,54 +666,136 @@ int main(int argc, char **argv) {
 
     char *buf = malloc(UNSH_BUFSIZE);
 
-    while (1) {
+    while (!s.quit) {
         int pending = epoll_wait(epollfd, events, UNSH_MAXEVENTS, -1);
         if (pending < 0) {
             perror("error waiting for new events");
             return 1;
         }
 
-        for (int i = 0; i < pending; i++) {
+        for (int i = 0; i < pending && !s.quit; i++) {
             uint32_t evcode = events[i].events;
             int fd = events[i].data.fd;
 
-            if (evcode & EPOLLERR) {
-                int sockerr;
-                size_t sockerrsize = sizeof(int);
-                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockerr, (socklen_t *)&sockerrsize) == 0) {
-                    // just quit here because we don't need to serve clients after
-                    error(1, sockerr, "fd error");
-                }
-
-            } else if (evcode & EPOLLHUP || evcode & EPOLLRDHUP) {
+            if (fd == 0) {
                 ssize_t thisread;
-                while ((thisread = read(sockfd, buf, UNSH_BUFSIZE)) > 0) {
-                    write(1, buf, thisread);
+                while ((thisread = read(0, buf, UNSH_BUFSIZE)) > 0) {
+                    session_input(&s, buf, thisread);
                 }
-                shutdown(sockfd, SHUT_RDWR);
-                close(sockfd);
-                return 0;
-
-            } else if (evcode & EPOLLIN) {
-                if (fd == 0) {
-                    ssize_t thisread;
-                    while ((thisread = read(0, buf, UNSH_BUFSIZE)) > 0) {
-                        write(sockfd, buf, thisread);
+                if (thisread == 0 || evcode & (EPOLLHUP | EPOLLERR)) {
+                    if (!s.cmd && s.linelen) {
+                        // last line without a newline
+                        session_submit(&s);
                     }
-
-                } else if (fd == sockfd) {
-                    ssize_t thisread;
-                    while ((thisread = read(sockfd, buf, UNSH_BUFSIZE)) > 0) {
-                        write(1, buf, thisread);
+                    if (s.cmd) {
+                        // end of input of the command, then back to reading commands
+                        unsh_cmd_close_input(s.cmd);
+                        epoll_ctl(epollfd, EPOLL_CTL_DEL, 0, NULL);
+                        s.stdinoff = true;
+                    } else {
+                        s.quit = true;
                     }
+                }
+
+            } else if (unsh_client_process(s.cl, 0) < 0) {
+                perror("error processing connection");
+                return 1;
+            }
+        }
 
+        if (s.stdinoff && !s.cmd) {
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, 0, &sockopts) < 0) {
+                perror("cannot set stdin epoll");
+                return 1;
+            }
+            s.stdinoff = false;
+        }
+    }
+
+    unsh_client_free(s.cl);
+    return s.status;
+}
+
+int main(int argc, char **argv) {
+    char *command = NULL;
+    size_t window = UNSH_FANOUT_WINDOW;
+    unsh_outmode outmode = OUTMODE_PREFIX;
+    const char *outdir = ".";
+    unsh_host *hosts = NULL;
+    size_t nhosts = 0;
+    bool compress = false;
+    // file transfer: 'G'et or 'P'ut, and whether to resume it
+    int xfer = 0;
+    bool resume = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:p:o:d:f:zGPC")) != -1) {
+        switch (opt) {
+            case 'c':
+                command = optarg;
+                break;
+            case 'z':
+                // compressed output, for slow links
+                compress = true;
+                break;
+            case 'G':
+            case 'P':
+                xfer = opt;
+                break;
+            case 'C':
+                resume = true;
+                break;
+            case 'p':
+                window = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                if (!strcmp(optarg, "prefix")) {
+                    outmode = OUTMODE_PREFIX;
+                } else if (!strcmp(optarg, "group")) {
+                    outmode = OUTMODE_GROUP;
+                } else if (!strcmp(optarg, "files")) {
+                    outmode = OUTMODE_FILES;
                 } else {
-                    fprintf(stderr, "unknown fd");
+                    usage(argv[0]);
                     return 1;
                 }
-            }
+                break;
+            case 'd':
+                outdir = optarg;
+                break;
+            case 'f':
+                if (read_hostfile(optarg, &hosts, &nhosts) < 0) {
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
 
-    return 0;
+    if (xfer) {
+        if (command || nhosts || argc - optind < 2 || argc - optind > 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        return transfer(argv[optind], xfer == 'G', argv[optind + 1], argv[optind + 2], resume, compress);
+    }
+
+    if (!command) {
+        if (nhosts || argc - optind > 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return interactive(optind < argc ? argv[optind] : NULL, compress);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        add_host(&hosts, &nhosts, argv[i]);
+    }
+    if (!nhosts || !window) {
+        usage(argv[0]);
+        return 1;
+    }
+    return fanout(hosts, nhosts, command, window, outmode, outdir, compress);
 }
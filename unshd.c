@@ -6,95 +6,665 @@
 #include <error.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <linux/ioprio.h>
 
+#include "cgroup.h"
+#include "chunk.h"
+#include "compress.h"
 #include "config.h"
+#include "handoff.h"
+#include "jobs.h"
+#include "offload.h"
+#include "pathcache.h"
+#include "protocol.h"
 #include "readcmd.h"
+#include "record.h"
 #include "sockdata.h"
+#include "stats.h"
+#include "trace.h"
+#include "xfer.h"
 
-int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
-    char ***seq = cmd->seq;
+// named pipelines that can be attached by other clients
+static unsh_socket *shared_pipelines = NULL;
+// connected clients, a restarted unshd exits once its own are gone
+static int nclients = 0;
+static bool draining = false;
+// SIGTERM or SIGINT, we stop at the end of the round
+static bool quitting = false;
+// what a graceful restart hands over, see handle_signal_read
+static char **restart_argv;
+static int listenfds[UNSH_LISTEN_MAX];
+static unsh_socket *listensocks[UNSH_LISTEN_MAX];
+static int nlisten = 0;
+static unsh_socket *handoffsock = NULL;
+// out of fds, the listeners are tried again once sockets are freed
+static bool accept_starved = false;
 
-    if (!*(seq)) {
-        return 0;
+// a pipeline whose redirections and command lookups may block, prepared on the helpers
+typedef struct unsh_spawnreq {
+    unsh_task task;
+    // NULL once the client has gone away
+    unsh_socket *clientsock;
+    // own copy, readcmd() reuses its result
+    struct cmdline *cmd;
+    // name to publish the pipeline under, for "share"
+    char *sharename;
+    int redirfd[2];
+    // errno of the redirection that could not be opened
+    int openerr;
+    const char *openfile;
+    char **exepaths;
+    // stages missing from the PATH cache, resolved by the helpers
+    bool *lookup;
+    // session PATH, NULL for the daemon's
+    char *path;
+    unsigned long generation;
+} unsh_spawnreq;
+
+void client_close(int epollfd, unsh_socket *clientsock);
+void client_check_finished(int epollfd, unsh_socket *clientsock);
+
+// returns the resulting capacity of the pipe
+int pipe_resize(int fd, int size) {
+    int ret = fcntl(fd, F_SETPIPE_SZ, size);
+    if (ret < 0) {
+        // above fs.pipe-max-size without CAP_SYS_RESOURCE, keep what we have
+        ret = fcntl(fd, F_GETPIPE_SZ);
     }
+    return ret;
+}
 
-    int cmdcount;
-    for (cmdcount = 0; seq[cmdcount]; cmdcount++);
+// for the error paths, ends already closed or never opened are -1
+void pipe_close(int fds[2]) {
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+// double the capacity of a pipe we keep filling, returns the new capacity
+int pipe_grow(int fd, int size) {
+    if (size >= UNSH_PIPE_SIZE_MAX) {
+        return size;
+    }
+    int newsize = pipe_resize(fd, size * 2 < UNSH_PIPE_SIZE_MAX ? size * 2 : UNSH_PIPE_SIZE_MAX);
+    if (newsize <= size) {
+        // cannot grow further, stop trying
+        return UNSH_PIPE_SIZE_MAX;
+    }
+    stats.pipe_grows++;
+    return newsize;
+}
+
+bool client_wants_input(unsh_sockaff_client *client) {
+    if (client->eof || client->state == CLIENTSTATE_WAITING || client->state == CLIENTSTATE_SPAWNING || client->state == CLIENTSTATE_GET) {
+        return false;
+    }
+    // a framed command arriving before the foreground job is over waits in the socket
+    if (client->framed && client->framehdrlen == UNSH_FRAME_HDRLEN && client->framehdr[0] == UNSH_FRAME_CMD && client->state != CLIENTSTATE_COMMAND) {
+        return false;
+    }
+    // stop reading while the foreground job is not keeping up with its input
+    return !client->inq.head;
+}
+
+void client_update_events(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    // the half-close is only reported once, EPOLLIN then reads up to the EOF
+    uint32_t events = client->rdhup ? 0 : EPOLLRDHUP;
+    if (client_wants_input(client)) {
+        events |= EPOLLIN;
+        // the header of a frame is already in, the socket may have nothing left to report
+        if (!(client->events & EPOLLIN) && client->framed && client->framehdrlen == UNSH_FRAME_HDRLEN) {
+            sock_requeue(clientsock, EPOLLIN);
+        }
+    }
+    if (client->outq.head || client->state == CLIENTSTATE_GET) {
+        events |= EPOLLOUT;
+    }
+    if (events == client->events) {
+        return;
+    }
+
+    // edge-triggered, but changing the mask reports what is already pending
+    struct epoll_event copts = {0};
+    copts.events = events | EPOLLET;
+    copts.data.ptr = clientsock;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, clientsock->fd, &copts) != 0) {
+        perror("cannot update client fd events");
+        return;
+    }
+    client->events = events;
+}
+
+// write a chunk to a client, queueing whatever the socket does not take right away
+void client_send_raw(int epollfd, unsh_socket *clientsock, unsh_chunk *chunk) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    size_t offset = 0;
+    // during a "get", other output waits for the end of the current frame
+    if (!client->outq.head && client->state != CLIENTSTATE_GET) {
+        ssize_t thiswrite = write(clientsock->fd, chunk->data, chunk->len);
+        if (thiswrite > 0) {
+            offset = thiswrite;
+        }
+        // hard errors are reported by epoll as EPOLLERR/EPOLLHUP
+    }
+    if (offset < chunk->len) {
+        outq_push(&client->outq, chunk, offset);
+        client_update_events(epollfd, clientsock);
+    }
+}
+
+// byte counts of the current command, for the session record
+void client_record_io(unsh_socket *clientsock, size_t in, size_t out) {
+    unsh_recsession *rec = clientsock->sockaff.client.rec;
+    if (rec) {
+        rec->in += in;
+        rec->out += out;
+    }
+}
+
+// send output to a client, as a data frame if it is in framed mode
+void client_send(int epollfd, unsh_socket *clientsock, unsh_chunk *chunk) {
+    client_record_io(clientsock, 0, chunk->len);
+    unsh_zout *zout = clientsock->sockaff.client.zout;
+    unsh_chunk *zchunk = zout ? zout_compress(zout, chunk) : NULL;
+    if (zchunk) {
+        client_send_raw(epollfd, clientsock, zchunk);
+        chunk_unref(zchunk);
+        return;
+    }
+    if (clientsock->sockaff.client.framed) {
+        unsh_chunk *hdr = chunk_new(UNSH_FRAME_HDRLEN);
+        unsh_frame_pack((unsigned char *)hdr->data, UNSH_FRAME_DATA, chunk->len);
+        hdr->len = UNSH_FRAME_HDRLEN;
+        client_send_raw(epollfd, clientsock, hdr);
+        chunk_unref(hdr);
+    }
+    client_send_raw(epollfd, clientsock, chunk);
+}
+
+// tell a framed client that its command is over
+void client_command_done(int epollfd, unsh_socket *clientsock, int status) {
+    record_done(clientsock->sockaff.client.rec, status);
+    if (!clientsock->sockaff.client.framed) {
+        return;
+    }
+    unsh_chunk *chunk = chunk_new(UNSH_FRAME_HDRLEN + 4);
+    unsigned char *ptr = (unsigned char *)chunk->data;
+    unsh_frame_pack(ptr, UNSH_FRAME_DONE, 4);
+    ptr[5] = (uint32_t)status >> 24;
+    ptr[6] = (uint32_t)status >> 16;
+    ptr[7] = (uint32_t)status >> 8;
+    ptr[8] = (uint32_t)status;
+    chunk->len = UNSH_FRAME_HDRLEN + 4;
+    client_send_raw(epollfd, clientsock, chunk);
+    chunk_unref(chunk);
+}
+
+void client_printf(int epollfd, unsh_socket *clientsock, const char *fmt, ...) {
+    unsh_chunk *chunk = chunk_new(UNSH_BUFSIZE);
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(chunk->data, UNSH_BUFSIZE, fmt, ap);
+    va_end(ap);
+    if (len > 0) {
+        chunk->len = len < UNSH_BUFSIZE ? (size_t)len : UNSH_BUFSIZE - 1;
+        client_send(epollfd, clientsock, chunk);
+    }
+    chunk_unref(chunk);
+}
+
+void client_stdin_close(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    outq_clear(&client->inq);
+    unsh_socket *hpsock = client->stdinsock;
+    if (hpsock) {
+        if (hpsock->sockaff.proc_in.polling && epoll_ctl(epollfd, EPOLL_CTL_DEL, hpsock->fd, NULL) != 0) {
+            perror("error unsetting proc_in fd events");
+        }
+        if (close(hpsock->fd) != 0) {
+            perror("error closing job input");
+        }
+        retiresock(hpsock);
+        client->stdinsock = NULL;
+    }
+}
+
+// pump client input to the foreground job, the rest waits in inq until the pipe drains
+void client_stdin_send(int epollfd, unsh_socket *clientsock, unsh_chunk *chunk) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    client_record_io(clientsock, chunk->len, 0);
+    if (!client->stdinsock) {
+        // the job does not read from the client, its input is discarded
+        return;
+    }
+
+    size_t offset = 0;
+    if (!client->inq.head) {
+        ssize_t thiswrite = write(client->stdinsock->fd, chunk->data, chunk->len);
+        if (thiswrite < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // the job closed its input
+            client_stdin_close(epollfd, clientsock);
+            return;
+        }
+        if (thiswrite > 0) {
+            offset = thiswrite;
+        }
+    }
+    if (offset < chunk->len) {
+        outq_push(&client->inq, chunk, offset);
+        unsh_socket *hpsock = client->stdinsock;
+        // the job is not keeping up with a full head pipe, let the client get further ahead
+        hpsock->sockaff.proc_in.pipesize = pipe_grow(hpsock->fd, hpsock->sockaff.proc_in.pipesize);
+        if (!hpsock->sockaff.proc_in.polling) {
+            struct epoll_event hpopts = {0};
+            hpopts.events = EPOLLOUT | EPOLLET;
+            hpopts.data.ptr = hpsock;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hpsock->fd, &hpopts) != 0) {
+                perror("cannot register child input pipe events");
+            } else {
+                hpsock->sockaff.proc_in.polling = true;
+            }
+        }
+        client_update_events(epollfd, clientsock);
+    }
+}
+
+unsh_socket *find_shared(const char *name) {
+    for (unsh_socket *posock = shared_pipelines; posock; posock = posock->sockaff.proc_out.nextshared) {
+        if (!strcmp(posock->sockaff.proc_out.name, name)) {
+            return posock;
+        }
+    }
+    return NULL;
+}
+
+void proc_out_pause(int epollfd, unsh_socket *posock) {
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, posock->fd, NULL) != 0) {
+        perror("cannot pause proc_out fd events");
+        return;
+    }
+    posock->sockaff.proc_out.paused = true;
+}
+
+void proc_out_resume(int epollfd, unsh_socket *posock) {
+    // adding it back reports what came in meanwhile, the hangup included
+    struct epoll_event tpopts = {0};
+    tpopts.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    tpopts.data.ptr = posock;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, posock->fd, &tpopts) != 0) {
+        perror("cannot resume proc_out fd events");
+        return;
+    }
+    posock->sockaff.proc_out.paused = false;
+}
+
+void proc_out_subscribe(unsh_socket *posock, unsh_socket *clientsock) {
+    unsh_sockaff_proc_out *po = &posock->sockaff.proc_out;
+    po->subscribers = realloc(po->subscribers, (po->nsubscribers + 1) * sizeof(unsh_socket *));
+    po->subscribers[po->nsubscribers++] = clientsock;
+}
+
+unsh_cgsession *client_cgroup(unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    if (!client->cgroup) {
+        client->cgroup = calloc(1, sizeof(unsh_cgsession));
+        cgroup_default_limits(&client->cgroup->limits);
+    }
+    return client->cgroup;
+}
+
+const char *job_status_string(unsh_job *job, char *buf, size_t size) {
+    if (WIFSIGNALED(job->status)) {
+        return strsignal(WTERMSIG(job->status));
+    } else if (WEXITSTATUS(job->status)) {
+        snprintf(buf, size, "Exit %d", WEXITSTATUS(job->status));
+        return buf;
+    }
+    return "Done";
+}
+
+// a job is over once its processes are reaped and its output is relayed
+void job_check_done(int epollfd, unsh_job *job) {
+    if (job->nlive || job->posock) {
+        return;
+    }
+
+    unsh_socket *clientsock = job->clientsock;
+    if (!clientsock) {
+        job_free(job);
+        return;
+    }
+
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    char usage[96] = "";
+    if (job->cgfd >= 0) {
+        unsh_cgsession *cg = client_cgroup(clientsock);
+        if (cgroup_usage(job->cgfd, &cg->last) == 0) {
+            cg->haslast = true;
+            usage[0] = '\t';
+            cgroup_format_usage(&cg->last, usage + 1, sizeof(usage) - 1);
+        }
+    }
+    if (client->fgjob == job) {
+        client_stdin_close(epollfd, clientsock);
+        client->fgjob = NULL;
+        client->state = CLIENTSTATE_COMMAND;
+        // shell convention for the exit status of a killed job
+        client_command_done(epollfd, clientsock, WIFSIGNALED(job->status) ? 128 + WTERMSIG(job->status) : WEXITSTATUS(job->status));
+    } else {
+        char buf[32];
+        client_printf(epollfd, clientsock, "[%d] %s\t%s%s\n", job->id, job_status_string(job, buf, sizeof(buf)), job->cmdline, usage);
+    }
+    job_free(job);
+
+    if (client->state == CLIENTSTATE_WAITING) {
+        if (client->waitjob ? !job_find(clientsock, client->waitjob) : !client->jobs) {
+            client->state = CLIENTSTATE_COMMAND;
+            client_command_done(epollfd, clientsock, 0);
+        }
+    }
+    client_update_events(epollfd, clientsock);
+    client_check_finished(epollfd, clientsock);
+}
+
+// pipeline output is finished or nobody is listening anymore
+void proc_out_close(int epollfd, unsh_socket *posock) {
+    unsh_sockaff_proc_out *po = &posock->sockaff.proc_out;
+
+    if (po->name) {
+        unsh_socket **link = &shared_pipelines;
+        while (*link != posock) {
+            link = &(*link)->sockaff.proc_out.nextshared;
+        }
+        *link = po->nextshared;
+    }
+
+    // watchers go back to their prompt, the owner does so when the job is over
+    for (size_t i = 0; i < po->nsubscribers; i++) {
+        unsh_socket *clientsock = po->subscribers[i];
+        if (clientsock != po->clientsock) {
+            clientsock->sockaff.client.attached = NULL;
+            clientsock->sockaff.client.state = CLIENTSTATE_COMMAND;
+            client_command_done(epollfd, clientsock, 0);
+            client_update_events(epollfd, clientsock);
+        }
+    }
+    po->nsubscribers = 0;
+
+    if (!po->paused && epoll_ctl(epollfd, EPOLL_CTL_DEL, posock->fd, NULL) != 0) {
+        perror("error unsetting proc_out fd events");
+    }
+    if (close(posock->fd) != 0) {
+        perror("error closing proc_out fd");
+    }
+    retiresock(posock);
+
+    if (po->job) {
+        po->job->posock = NULL;
+        job_check_done(epollfd, po->job);
+        po->job = NULL;
+    }
+}
+
+void proc_out_unsubscribe(int epollfd, unsh_socket *posock, unsh_socket *clientsock) {
+    unsh_sockaff_proc_out *po = &posock->sockaff.proc_out;
+    for (size_t i = 0; i < po->nsubscribers; i++) {
+        if (po->subscribers[i] == clientsock) {
+            po->subscribers[i] = po->subscribers[--po->nsubscribers];
+            break;
+        }
+    }
+    if (po->clientsock == clientsock) {
+        po->clientsock = NULL;
+    }
+
+    if (!po->nsubscribers) {
+        proc_out_close(epollfd, posock);
+    }
+}
+
+// hand one chunk of pipeline output to every subscriber without copying it
+void proc_out_broadcast(int epollfd, unsh_socket *posock, unsh_chunk *chunk) {
+    unsh_sockaff_proc_out *po = &posock->sockaff.proc_out;
+    // backwards, lagging framed watchers are removed as we go
+    for (size_t i = po->nsubscribers; i-- > 0;) {
+        unsh_socket *clientsock = po->subscribers[i];
+        unsh_sockaff_client *client = &clientsock->sockaff.client;
+        client_send(epollfd, clientsock, chunk);
+        if (client->outq.bytes <= UNSH_OUTQ_MAX) {
+            continue;
+        }
+        if (po->name && client->framed) {
+            // cannot drop part of a frame stream, disconnect the watcher instead
+            client_close(epollfd, clientsock);
+        } else if (po->name) {
+            // a slow watcher must not hold back the others, drop its backlog only
+            size_t dropped = client->outq.bytes;
+            outq_clear(&client->outq);
+            client_printf(epollfd, clientsock, "unsh: output lagging, %zu bytes dropped\n", dropped);
+        } else if (!po->paused) {
+            // private pipeline: stop reading until the client catches up
+            proc_out_pause(epollfd, posock);
+        }
+    }
+}
+
+void client_close(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    client_stdin_close(epollfd, clientsock);
+    if (client->attached) {
+        proc_out_unsubscribe(epollfd, client->attached, clientsock);
+        client->attached = NULL;
+    }
+    // a helper may still be working on it, it is dropped once done
+    if (client->spawnreq) {
+        client->spawnreq->clientsock = NULL;
+        client->spawnreq = NULL;
+    }
+
+    // jobs still watched by others keep running, the rest are hung up like in a shell
+    client->fgjob = NULL;
+    while (client->jobs) {
+        unsh_job *job = client->jobs;
+        unsh_socket *posock = job->posock;
+        job_detach(job);
+        if (job->nlive && (!posock || posock->sockaff.proc_out.nsubscribers == 1)) {
+            kill(-job->pgid, SIGHUP);
+        }
+        // either call may free the job
+        if (posock) {
+            proc_out_unsubscribe(epollfd, posock, clientsock);
+        } else {
+            job_check_done(epollfd, job);
+        }
+    }
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, clientsock->fd, NULL) != 0) {
+        perror("error unsetting client fd events");
+    }
+    if (close(clientsock->fd) != 0) {
+        perror("error closing client fd");
+    }
+    client->state = CLIENTSTATE_CLOSED;
+    retiresock(clientsock);
+    nclients--;
+}
+
+// a client that closed its input is let go once it has nothing left to receive
+void client_check_finished(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    if (!clientsock->dead && client->eof && !client->jobs && !client->spawnreq && !client->outq.head) {
+        client_close(epollfd, clientsock);
+    }
+}
+
+// the client shut down its sending side, like "ssh host cmd < file"
+void client_input_eof(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    client->eof = true;
+    if (client->state == CLIENTSTATE_ATTACHED) {
+        client_close(epollfd, clientsock);
+        return;
+    }
+    // the foreground job sees the end of its input
+    client_stdin_close(epollfd, clientsock);
+    client_update_events(epollfd, clientsock);
+    client_check_finished(epollfd, clientsock);
+}
+
+// human-readable command line for the job table
+char *cmdline_string(struct cmdline *cmd) {
+    size_t len = 1;
+    for (char ***seq = cmd->seq; *seq; seq++) {
+        for (char **word = *seq; *word; word++) {
+            len += strlen(*word) + 1;
+        }
+        len += 2;
+    }
+    char *ret = malloc(len);
+    char *ptr = ret;
+    for (char ***seq = cmd->seq; *seq; seq++) {
+        if (seq != cmd->seq) {
+            ptr = stpcpy(ptr, "| ");
+        }
+        for (char **word = *seq; *word; word++) {
+            ptr = stpcpy(ptr, *word);
+            *ptr++ = ' ';
+        }
+    }
+    if (ptr != ret) {
+        ptr--;
+    }
+    *ptr = 0;
+    return ret;
+}
+
+// redirfd are the opened redirections or -1, closed once the pipeline is running
+// exepaths has the resolved path of every stage, NULL if not found
+int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd, int redirfd[2], char **exepaths) {
+    char ***seq = cmd->seq;
+    unsh_env *env = &clientsock->sockaff.client.env;
+    bool background = cmd->backgrounded != NULL;
+    bool batch = clientsock->sockaff.client.batch;
+    bool infile = redirfd[0] >= 0;
+    bool outfile = redirfd[1] >= 0;
 
-    // in case of io redir
-    int redirfd[2] = {-1, -1};
     // pipes for communicating with child processes
-    int headpipe[2];
-    int tailpipe[2];
+    int headpipe[2] = {-1, -1};
+    int tailpipe[2] = {-1, -1};
     // pipeline chain
-    int before[2], after[2];
+    int before[2] = {-1, -1}, after[2] = {-1, -1};
     bool beginning = true;
+    int headsize = 0, tailsize;
 
     // setup head-of-pipe and tail-of-pipe
-    // if redirected to client then these must be non-blocking for use with epoll()
-    if (cmd->in) {
-        redirfd[0] = open(cmd->in, O_RDONLY);
-        if (redirfd[0] < 0) {
-            perror("cannot open input file");
-            return -1;
-        }
-    } else {
-        if (pipe2(headpipe, O_NONBLOCK) < 0) {
+    // if redirected to client then our ends must be non-blocking for use with epoll()
+    // the children's ends stay blocking, or they would fail with EAGAIN under backpressure
+    if (!infile) {
+        if (pipe2(headpipe, O_CLOEXEC) < 0) {
             perror("cannot create head pipe");
             return -1;
         }
-        // no need to register head pipe with epoll() since we won't be polling from it
-    }
-
-    if (cmd->out) {
-        redirfd[1] = open(cmd->out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (redirfd[1] < 0) {
-            perror("cannot open output file");
+        if (fcntl(headpipe[1], F_SETFL, O_NONBLOCK) < 0) {
+            perror("cannot set head pipe state");
+            pipe_close(headpipe);
             return -1;
         }
+        headsize = pipe_resize(headpipe[1], UNSH_PIPE_SIZE);
+        // head pipe is only registered with epoll() while it is full
     }
 
-    if (pipe2(tailpipe, O_NONBLOCK) < 0) {
+    if (pipe2(tailpipe, O_CLOEXEC) < 0) {
         perror("cannot create tail pipe");
+        pipe_close(headpipe);
+        return -1;
+    }
+    tailsize = pipe_resize(tailpipe[0], UNSH_PIPE_SIZE);
+    if (fcntl(tailpipe[0], F_SETFL, O_NONBLOCK) < 0) {
+        perror("cannot set tail pipe state");
+        pipe_close(headpipe);
+        pipe_close(tailpipe);
         return -1;
     }
 
     struct epoll_event tpopts = {0};
-    tpopts.events = EPOLLIN | EPOLLRDHUP;
+    tpopts.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
     unsh_socket *tpsock = newsock(tailpipe[0], (unsh_sockettype)SOCKETTYPE_PROC_OUT, true);
     tpsock->sockaff.proc_out.clientsock = clientsock;
+    tpsock->sockaff.proc_out.pipesize = tailsize;
+    tpsock->sockaff.proc_out.batch = batch;
     tpopts.data.ptr = tpsock;
     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, tailpipe[0], &tpopts) != 0) {
         perror("cannot register child pipe events");
+        freesock(tpsock);
+        pipe_close(headpipe);
+        pipe_close(tailpipe);
         return -1;
     }
+    proc_out_subscribe(tpsock, clientsock);
 
-    clientsock->sockaff.client.haspipe = true;
+    unsh_job *job = job_new(clientsock, background, cmdline_string(cmd));
+    job->batch = batch;
+    job->posock = tpsock;
+    tpsock->sockaff.proc_out.job = job;
+    if (cgroup_enabled()) {
+        unsh_cglimits limits = client_cgroup(clientsock)->limits;
+        // nice values only matter within a cgroup, between cgroups it is their weight
+        if (batch) {
+            cgroup_scale_weight(&limits, UNSH_BATCH_CPU_SHARE);
+        }
+        job->cgfd = cgroup_new(&limits, &job->cgid);
+    }
 
     while (*seq) {
         char **current = *seq++;
+        // resolved in the parent so the child does a single execve()
+        const char *exepath = *exepaths++;
 
         if (*seq) {
             // not the end of the pipe yet
-            if (pipe(after) < 0) {
+            if (pipe2(after, O_CLOEXEC) < 0) {
                 perror("cannot create pipe");
+                after[0] = after[1] = -1;
+                goto fail;
             }
+            pipe_resize(after[0], UNSH_PIPE_SIZE);
         }
 
         pid_t pid = fork();
         if (!pid) {
+            // one process group per job, so that it can be signalled as a whole
+            setpgid(0, job->pgid);
+            if (job->cgfd >= 0) {
+                cgroup_enter(job->cgfd);
+            }
+            // inherited by whatever the stage forks, failures leave it at our priority
+            if (batch) {
+                setpriority(PRIO_PROCESS, 0, UNSH_BATCH_NICE);
+                syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, UNSH_BATCH_IOPRIO));
+            }
+
             if (beginning) {
-                if (cmd->in) {
+                if (infile) {
                     dup2(redirfd[0], 0);
                 } else {
                     dup2(headpipe[0], 0);
@@ -105,7 +675,7 @@ int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
                 close(before[1]);
             }
 
-            if (cmd->in) {
+            if (infile) {
                 close(redirfd[0]);
             } else {
                 close(headpipe[0]);
@@ -114,7 +684,7 @@ int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
 
             if (!*seq) {
                 // end of pipe
-                if (cmd->out) {
+                if (outfile) {
                     dup2(redirfd[1], 1);
                     dup2(tailpipe[1], 2);
                 } else {
@@ -127,7 +697,7 @@ int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
                 close(after[1]);
             }
 
-            if (cmd->out) {
+            if (outfile) {
                 close(redirfd[1]);
             }
 
@@ -137,58 +707,62 @@ int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
             sigset_t sigset;
             if (sigemptyset(&sigset) != 0) {
                 perror("cannot initialize signal set");
-                return 1;
+                _exit(127);
             }
             if (sigprocmask(SIG_SETMASK, &sigset, NULL) != 0) {
                 perror("cannot unmask signals before exec");
-                return 1;
+                _exit(127);
             }
 
-            execvp(current[0], current);
+            if (exepath) {
+                execve(exepath, current, env_vars(env));
+            } else {
+                errno = ENOENT;
+            }
             perror("cannot exec");
-            return -1;
+            // never return into the event loop from the child
+            _exit(127);
 
         } else if (pid > 0) {
+            UNSH_TRACE_INSTANT(TRACE_FORK, pid);
+            // also set from the parent, the child may not have run yet when we signal it
+            setpgid(pid, job->pgid ? job->pgid : pid);
+            job_addpid(job, pid);
             if (!beginning) {
                 close(before[0]);
                 close(before[1]);
             }
             before[0] = after[0];
             before[1] = after[1];
+            after[0] = after[1] = -1;
             beginning = false;
 
         } else {
             perror("cannot fork");
-            return -1;
+            goto fail;
         }
     }
 
-    if (cmd->in) {
+    if (infile) {
         close(redirfd[0]);
     } else {
         close(headpipe[0]);
         //close(headpipe[1]);
 
-        clientsock->sockaff.client.writeinfd = headpipe[1];
-        clientsock->sockaff.client.state = CLIENTSTATE_INPUT;
-
-        // we only monitor output side of pipe for now
-        // monitoring read side of pipe is not implemented yet
-        // writes returning EAGAIN may behave badly
-        /*
-        struct epoll_event hpopts = {0};
-        hpopts.events = EPOLLIN | EPOLLRDHUP;
         unsh_socket *hpsock = newsock(headpipe[1], (unsh_sockettype)SOCKETTYPE_PROC_IN, true);
         hpsock->sockaff.proc_in.clientsock = clientsock;
-        hpopts.data.ptr = hpsock;
-        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, headpipe[1], &hpopts) != 0) {
-            perror("cannot register child input pipe events");
-            return -1;
-        }
-        */
+        hpsock->sockaff.proc_in.pipesize = headsize;
+        clientsock->sockaff.client.stdinsock = hpsock;
+    }
+
+    if (background) {
+        client_printf(epollfd, clientsock, "[%d] %d\n", job->id, job->pgid);
+    } else {
+        clientsock->sockaff.client.fgjob = job;
+        clientsock->sockaff.client.state = CLIENTSTATE_INPUT;
     }
 
-    if (cmd->out) {
+    if (outfile) {
         close(redirfd[1]);
     }
 
@@ -196,285 +770,1479 @@ int cmdspawn(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
     close(tailpipe[1]);
 
     return 0;
-}
 
-int handle_client_read(int epollfd, unsh_socket *sockdt) {
-    int fd = sockdt->fd;
-    unsh_sockaff_client client = sockdt->sockaff.client;
+fail:
+    // redirections stay with the caller
+    pipe_close(after);
+    pipe_close(before);
+    pipe_close(headpipe);
+    close(tailpipe[1]);
+    if (job->npids) {
+        // stages already running lose the rest of their pipeline, the job reports them once reaped
+        kill(-job->pgid, SIGKILL);
+    } else {
+        tpsock->sockaff.proc_out.job = NULL;
+        job_free(job);
+        proc_out_close(epollfd, tpsock);
+    }
+    return -1;
+}
 
-    if (client.state == CLIENTSTATE_COMMAND) {
-        ssize_t thisread;
-        char *lineptr = client.linebuf + client.linelen;
-        while ((thisread = read(fd, lineptr, 1)) > 0) {
-            char readed = *(char *)lineptr;
-            if (client.linelen >= UNSH_LINE_MAX - 1) {
-                client.linelen = 0;
-                lineptr = client.linebuf;
-            } else if (readed == '\r' || readed == '\n') {
-                *lineptr++ = 0;
-                struct cmdline *cmd = readcmd(client.linebuf);
-                // luckily for us exec() won't mess up parent's epoll
-                if (cmdspawn(epollfd, sockdt, cmd) == -1) {
-                    perror("command spawn failed");
-                }
-                break;
-            } else {
-                client.linelen++;
-                lineptr++;
-            }
-        }
-        if (thisread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return 0;
+void spawnreq_free(unsh_spawnreq *req) {
+    for (int i = 0; i < 2; i++) {
+        if (req->redirfd[i] >= 0) {
+            close(req->redirfd[i]);
         }
-        return thisread;
+    }
+    for (int i = 0; req->cmd->seq[i]; i++) {
+        free(req->exepaths[i]);
+    }
+    free(req->exepaths);
+    free(req->lookup);
+    free(req->path);
+    free(req->sharename);
+    cmdfree(req->cmd);
+    free(req);
+}
 
-    } else if (client.state == CLIENTSTATE_INPUT) {
-        return 0;
-        // NOTE: NOT IMPLEMENTED
-        ssize_t thisread;
-        char *buf = malloc(UNSH_BUFSIZE);
-        // read from client socket and pump it to child stdin
-        while ((thisread = read(fd, buf, UNSH_BUFSIZE)) > 0) {
-            write(client.writeinfd, buf, thisread);
-        }
-        if (thisread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return 0;
+// runs on a helper thread
+void spawn_work(unsh_task *task) {
+    unsh_spawnreq *req = (unsh_spawnreq *)task;
+    struct cmdline *cmd = req->cmd;
+    if (cmd->in && (req->redirfd[0] = open(cmd->in, O_RDONLY | O_CLOEXEC)) < 0) {
+        req->openerr = errno;
+        req->openfile = cmd->in;
+        return;
+    }
+    if (cmd->out && (req->redirfd[1] = open(cmd->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        req->openerr = errno;
+        req->openfile = cmd->out;
+        return;
+    }
+    for (int i = 0; cmd->seq[i]; i++) {
+        if (req->lookup[i]) {
+            req->exepaths[i] = pathcache_resolve(cmd->seq[i][0], req->path);
         }
-        return thisread;
-
-    } else {
-        fprintf(stderr, "unknown client state");
-        return -1;
     }
 }
 
-int handle_proc_out_read(unsh_socket *sockdt) {
-    // TODO: use a constrained for loop rather than a while loop to avoid starving other fds
-    assert(sockdt->socktype == SOCKETTYPE_PROC_OUT);
-
-    unsh_socket *clientsock = sockdt->sockaff.proc_out.clientsock;
-
-    int fd = sockdt->fd;
-    ssize_t thisread;
-    char *buf = malloc(UNSH_BUFSIZE);
-    while ((thisread = read(fd, buf, UNSH_BUFSIZE)) > 0) {
-        write(clientsock->fd, buf, thisread);
+void share_publish(int epollfd, unsh_socket *clientsock, const char *name) {
+    // the name may have been taken while the pipeline was being prepared
+    if (find_shared(name)) {
+        client_printf(epollfd, clientsock, "unsh: pipeline %s already exists\n", name);
+        return;
     }
-    if (thisread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        return 0;
+    unsh_job *job = job_find(clientsock, clientsock->sockaff.client.nextjobid - 1);
+    unsh_socket *posock = job ? job->posock : NULL;
+    if (posock) {
+        posock->sockaff.proc_out.name = strdup(name);
+        posock->sockaff.proc_out.nextshared = shared_pipelines;
+        shared_pipelines = posock;
     }
-    return thisread;
 }
 
-int main() {
-    sigset_t chs;
-    if (sigemptyset(&chs) != 0) {
-        perror("cannot initialize signal set");
+// returns the status of the command line
+int spawn_finish(int epollfd, unsh_spawnreq *req) {
+    unsh_socket *clientsock = req->clientsock;
+    if (req->openerr) {
+        client_printf(epollfd, clientsock, "unsh: %s: %s\n", req->openfile, strerror(req->openerr));
         return 1;
     }
-    if (sigaddset(&chs, SIGCHLD) != 0) {
-        perror("cannot initialize signal set");
-        return 1;
+    // luckily for us exec() won't mess up parent's epoll
+    if (cmdspawn(epollfd, clientsock, req->cmd, req->redirfd, req->exepaths) == -1) {
+        perror("command spawn failed");
+        return 127;
     }
-    if (sigprocmask(SIG_BLOCK, &chs, NULL) != 0) {
-        perror("cannot mask signals");
-        return 1;
+    req->redirfd[0] = req->redirfd[1] = -1;
+    if (req->sharename) {
+        share_publish(epollfd, clientsock, req->sharename);
     }
+    return 0;
+}
 
-    int sigfd = signalfd(-1, &chs, SFD_NONBLOCK);
-    if (sigfd < 0) {
-        perror("error registering signalfd");
-        return 1;
+// runs on the event loop
+void spawn_done(int epollfd, unsh_task *task) {
+    unsh_spawnreq *req = (unsh_spawnreq *)task;
+    struct cmdline *cmd = req->cmd;
+    // spawn_work() stops before the lookups when a redirection fails to open
+    for (int i = 0; cmd->seq[i] && !req->openerr; i++) {
+        if (req->lookup[i]) {
+            pathcache_insert(cmd->seq[i][0], req->path, req->exepaths[i], req->generation);
+        }
     }
 
-    if (sigaddset(&chs, SIGPIPE) != 0) {
-        perror("cannot initialize signal set");
-        return 1;
-    }
-    if (sigprocmask(SIG_BLOCK, &chs, NULL) != 0) {
-        perror("cannot mask signals");
-        return 1;
+    unsh_socket *clientsock = req->clientsock;
+    if (clientsock) {
+        unsh_sockaff_client *client = &clientsock->sockaff.client;
+        client->spawnreq = NULL;
+        client->state = CLIENTSTATE_COMMAND;
+        int status = spawn_finish(epollfd, req);
+        if (client->state == CLIENTSTATE_COMMAND) {
+            client_command_done(epollfd, clientsock, status);
+        }
+        client_update_events(epollfd, clientsock);
+        client_check_finished(epollfd, clientsock);
     }
+    spawnreq_free(req);
+}
 
-    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (sockfd < 0) {
-        perror("error creating sockfd");
-        return 1;
+// start a pipeline, returns its status if it could be started or failed right away
+// otherwise the client is left in CLIENTSTATE_SPAWNING until the helpers are done
+int spawn_start(int epollfd, unsh_socket *clientsock, struct cmdline *cmd, const char *sharename) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    if (!cmd->seq[0]) {
+        return 0;
     }
 
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) != 0) {
-        perror("error setting SO_REUSEADDR");
-        return 1;
-    }
+    int cmdcount;
+    for (cmdcount = 0; cmd->seq[cmdcount]; cmdcount++);
 
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(struct sockaddr_in));
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    sa.sin_port = htons(UNSH_PORT);
+    unsh_spawnreq *req = calloc(1, sizeof(unsh_spawnreq));
+    req->task.work = spawn_work;
+    req->task.done = spawn_done;
+    req->clientsock = clientsock;
+    req->cmd = cmddup(cmd);
+    req->sharename = sharename ? strdup(sharename) : NULL;
+    req->redirfd[0] = req->redirfd[1] = -1;
+    req->exepaths = calloc(cmdcount, sizeof(char *));
+    req->lookup = calloc(cmdcount, sizeof(bool));
 
-    if (bind(sockfd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0) {
-        perror("error binding");
-        return 1;
+    // opening a file can hang on a slow mount or a fifo, always leave it to the helpers
+    bool offload = cmd->in || cmd->out;
+    const char *path = env_get(&client->env, "PATH");
+    UNSH_TRACE_BEGIN(TRACE_LOOKUP, clientsock->fd);
+    for (int i = 0; i < cmdcount; i++) {
+        const char *name = cmd->seq[i][0];
+        const char *exepath;
+        if (strchr(name, '/')) {
+            req->exepaths[i] = strdup(name);
+        } else if (pathcache_peek(name, path, &exepath)) {
+            req->exepaths[i] = exepath ? strdup(exepath) : NULL;
+        } else {
+            req->lookup[i] = true;
+            offload = true;
+        }
     }
+    UNSH_TRACE_END(TRACE_LOOKUP, clientsock->fd);
 
-    if (listen(sockfd, 5) < 0) {
-        perror("error listening");
-        return 1;
+    // background jobs do not get the client's input
+    if (!cmd->in && cmd->backgrounded) {
+        req->redirfd[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (req->redirfd[0] < 0) {
+            perror("cannot open /dev/null");
+            spawnreq_free(req);
+            return 127;
+        }
     }
 
-    int epollfd = epoll_create1(SOCK_CLOEXEC);
-    if (epollfd <= 0) {
-        perror("error creating epoll");
-        return 1;
+    if (!offload) {
+        int status = spawn_finish(epollfd, req);
+        spawnreq_free(req);
+        return status;
     }
 
-    struct epoll_event *events = malloc(UNSH_MAXEVENTS * sizeof(struct epoll_event));
+    req->path = path ? strdup(path) : NULL;
+    req->generation = pathcache_generation();
+    client->spawnreq = req;
+    client->state = CLIENTSTATE_SPAWNING;
+    client_update_events(epollfd, clientsock);
+    UNSH_TRACE_INSTANT(TRACE_OFFLOAD, clientsock->fd);
+    offload_submit(&req->task);
+    return 0;
+}
 
-    // register server socket gives us accept() notifications
-    struct epoll_event ssopts = {0};
-    ssopts.events = EPOLLIN;
-    ssopts.data.ptr = newsock(sockfd, SOCKETTYPE_SERVER, true);
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ssopts) != 0) {
-        perror("cannot set sockfd events");
-        return 1;
+// end of a "get" or "put", the command is over
+void client_xfer_done(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    unsh_xfer *x = client->xfer;
+    int status = 0;
+    client->xfer = NULL;
+    client->state = CLIENTSTATE_COMMAND;
+    if (x->err) {
+        client_printf(epollfd, clientsock, "unsh: cannot write file: %s\n", strerror(x->err));
+        status = 1;
     }
+    xfer_free(x);
+    client_command_done(epollfd, clientsock, status);
+    client_update_events(epollfd, clientsock);
+}
 
-    // register signalfd
-    struct epoll_event sigopts = {0};
-    sigopts.events = EPOLLIN;
-    sigopts.data.ptr = newsock(sigfd, SOCKETTYPE_SIGNAL, true);
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sigfd, &sigopts) != 0) {
-        perror("cannot set sigfd events");
-        return 1;
+// send the file of a "get" as far as the socket takes it, at most a frame's worth per call
+// returns the file bytes sent
+size_t client_get_pump(int epollfd, unsh_socket *clientsock) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    unsh_xfer *x = client->xfer;
+    size_t sent = 0;
+    while (sent < UNSH_XFER_FRAME) {
+        if (!x->frameleft && !x->hdrleft) {
+            // output of the other jobs goes out between frames
+            if (client->outq.head && outq_flush(&client->outq, clientsock->fd) < 0) {
+                outq_clear(&client->outq);
+            }
+            if (client->outq.head) {
+                break;
+            }
+            if (!x->left) {
+                client_xfer_done(epollfd, clientsock);
+                return sent;
+            }
+            if (client->framed) {
+                x->frameleft = x->left < UNSH_XFER_FRAME ? (size_t)x->left : UNSH_XFER_FRAME;
+                unsh_frame_pack(x->hdr, UNSH_FRAME_DATA, x->frameleft);
+                x->hdrleft = UNSH_FRAME_HDRLEN;
+            } else {
+                x->frameleft = x->left;
+            }
+        }
+
+        ssize_t thiswrite;
+        if (x->hdrleft) {
+            thiswrite = write(clientsock->fd, x->hdr + UNSH_FRAME_HDRLEN - x->hdrleft, x->hdrleft);
+            if (thiswrite > 0) {
+                x->hdrleft -= thiswrite;
+            }
+        } else {
+            thiswrite = xfer_send(x, clientsock->fd, x->frameleft);
+            if (thiswrite > 0) {
+                client_record_io(clientsock, 0, thiswrite);
+                x->frameleft -= thiswrite;
+                x->left -= thiswrite;
+                sent += thiswrite;
+            }
+        }
+        if (thiswrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (thiswrite <= 0) {
+            // the frame cannot be completed, neither can the stream
+            if (thiswrite == 0) {
+                fprintf(stderr, "file shrank during get\n");
+            } else {
+                perror("error sending file");
+            }
+            client_close(epollfd, clientsock);
+            return sent;
+        }
+    }
+    if (sent >= UNSH_XFER_FRAME) {
+        // the socket may still take more, no edge will say so
+        sock_requeue(clientsock, EPOLLOUT);
     }
+    client_update_events(epollfd, clientsock);
+    return sent;
+}
 
-    while (1) {
-        int pending = epoll_wait(epollfd, events, UNSH_MAXEVENTS, -1);
-        if (pending < 0) {
-            perror("error waiting for new event");
+// open the file of a transfer, offset must not be past its end
+int xfer_open(int epollfd, unsh_socket *clientsock, const char *path, int flags, off_t offset) {
+    // regular files do not block on open, and O_NONBLOCK keeps a fifo from doing so
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        client_printf(epollfd, clientsock, "unsh: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || offset > st.st_size) {
+        client_printf(epollfd, clientsock, "unsh: %s: %s\n", path, S_ISREG(st.st_mode) ? "offset past the end of the file" : "not a regular file");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// send a file, from offset on, as the output of the command
+int builtin_get(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    char **first = cmd->seq[0];
+    off_t offset;
+    if (!first[1] || (first[2] && first[3]) || xfer_parse_offset(first[2], &offset) < 0) {
+        client_printf(epollfd, clientsock, "usage: get PATH [OFFSET]\n");
+        return -1;
+    }
+    int fd = xfer_open(epollfd, clientsock, first[1], O_RDONLY, offset);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    client->xfer = xfer_new(fd, offset, 0);
+    client->xfer->left = st.st_size - offset;
+    // sent once the socket is writable, the transfer ends the command
+    client->state = CLIENTSTATE_GET;
+    client_update_events(epollfd, clientsock);
+    return 0;
+}
+
+// write the input of the command to a file, from offset on
+int builtin_put(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    char **first = cmd->seq[0];
+    off_t offset;
+    if (!first[1] || (first[2] && first[3]) || xfer_parse_offset(first[2], &offset) < 0) {
+        client_printf(epollfd, clientsock, "usage: put PATH [OFFSET]\n");
+        return -1;
+    }
+    int fd = xfer_open(epollfd, clientsock, first[1], O_WRONLY | O_CREAT, offset);
+    if (fd < 0) {
+        return -1;
+    }
+    // whatever is past the offset is left over from an interrupted transfer or an older file
+    if (ftruncate(fd, offset) < 0) {
+        client_printf(epollfd, clientsock, "unsh: %s: %s\n", first[1], strerror(errno));
+        close(fd);
+        return -1;
+    }
+    client->xfer = xfer_new(fd, offset, UNSH_PIPE_SIZE);
+    if (!client->xfer) {
+        perror("cannot create transfer pipe");
+        close(fd);
+        return -1;
+    }
+    // the end of input ends the command
+    client->state = CLIENTSTATE_PUT;
+    return 0;
+}
+
+// size of a file, for resuming transfers
+int builtin_size(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    char **first = cmd->seq[0];
+    struct stat st;
+    if (!first[1] || first[2]) {
+        client_printf(epollfd, clientsock, "usage: size PATH\n");
+        return -1;
+    }
+    if (stat(first[1], &st) < 0) {
+        client_printf(epollfd, clientsock, "unsh: %s: %s\n", first[1], strerror(errno));
+        return -1;
+    }
+    client_printf(epollfd, clientsock, "%lld\n", (long long)st.st_size);
+    return 0;
+}
+
+int builtin_share(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    char **first = cmd->seq[0];
+    if (!first[1] || !first[2]) {
+        client_printf(epollfd, clientsock, "usage: share NAME COMMAND...\n");
+        return -1;
+    }
+    if (find_shared(first[1])) {
+        client_printf(epollfd, clientsock, "unsh: pipeline %s already exists\n", first[1]);
+        return -1;
+    }
+
+    // spawn the rest of the line as a normal pipeline, then publish it
+    cmd->seq[0] = first + 2;
+    int ret = spawn_start(epollfd, clientsock, cmd, first[1]);
+    cmd->seq[0] = first;
+    return ret ? -1 : 0;
+}
+
+int builtin_attach(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    char **first = cmd->seq[0];
+    if (!first[1]) {
+        client_printf(epollfd, clientsock, "usage: attach NAME\n");
+        return -1;
+    }
+    unsh_socket *posock = find_shared(first[1]);
+    if (!posock) {
+        client_printf(epollfd, clientsock, "unsh: no such pipeline %s\n", first[1]);
+        return -1;
+    }
+    if (posock->sockaff.proc_out.clientsock == clientsock) {
+        client_printf(epollfd, clientsock, "unsh: pipeline %s is already ours\n", first[1]);
+        return -1;
+    }
+    proc_out_subscribe(posock, clientsock);
+    clientsock->sockaff.client.attached = posock;
+    clientsock->sockaff.client.state = CLIENTSTATE_ATTACHED;
+    return 0;
+}
+
+// parse a "%n" or "n" job reference
+unsh_job *builtin_jobarg(int epollfd, unsh_socket *clientsock, const char *arg) {
+    char *end;
+    long id = strtol(arg[0] == '%' ? arg + 1 : arg, &end, 10);
+    unsh_job *job = *end ? NULL : job_find(clientsock, id);
+    if (!job) {
+        client_printf(epollfd, clientsock, "unsh: %s: no such job\n", arg);
+    }
+    return job;
+}
+
+int builtin_jobs(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    (void)cmd;
+    for (unsh_job *job = clientsock->sockaff.client.jobs; job; job = job->next) {
+        char buf[32];
+        const char *status = job->nlive ? "Running" : job_status_string(job, buf, sizeof(buf));
+        client_printf(epollfd, clientsock, "[%d] %d %s%s\t%s\n", job->id, job->pgid, status, job->batch ? " batch" : "", job->cmdline);
+    }
+    return 0;
+}
+
+int builtin_wait(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    char **first = cmd->seq[0];
+    client->waitjob = 0;
+    if (first[1]) {
+        unsh_job *job = builtin_jobarg(epollfd, clientsock, first[1]);
+        if (!job) {
+            return -1;
+        }
+        client->waitjob = job->id;
+    } else if (!client->jobs) {
+        return 0;
+    }
+    // the client is not read until job_check_done() sees the jobs finish
+    client->state = CLIENTSTATE_WAITING;
+    client_update_events(epollfd, clientsock);
+    return 0;
+}
+
+int builtin_kill(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    char **args = cmd->seq[0] + 1;
+    int sig = SIGTERM;
+    if (*args && (*args)[0] == '-') {
+        char *end;
+        sig = strtol(*args + 1, &end, 10);
+        if (*end || sig <= 0 || sig >= NSIG) {
+            client_printf(epollfd, clientsock, "unsh: %s: invalid signal\n", *args);
+            return -1;
+        }
+        args++;
+    }
+    if (!*args) {
+        client_printf(epollfd, clientsock, "usage: kill [-SIGNUM] %%JOB...\n");
+        return -1;
+    }
+    for (; *args; args++) {
+        unsh_job *job = builtin_jobarg(epollfd, clientsock, *args);
+        if (job && job->nlive && kill(-job->pgid, sig) != 0) {
+            client_printf(epollfd, clientsock, "unsh: kill %s: %s\n", *args, strerror(errno));
+        }
+    }
+    return 0;
+}
+
+// export NAME=VALUE..., or list the session environment
+int builtin_export(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_env *env = &clientsock->sockaff.client.env;
+    char **args = cmd->seq[0] + 1;
+    if (!*args) {
+        for (char **var = env_vars(env); *var; var++) {
+            client_printf(epollfd, clientsock, "export %s\n", *var);
+        }
+        return 0;
+    }
+    int ret = 0;
+    for (; *args; args++) {
+        char *eq = strchr(*args, '=');
+        size_t namelen = eq ? (size_t)(eq - *args) : strlen(*args);
+        if (!env_valid_name(*args, namelen)) {
+            client_printf(epollfd, clientsock, "unsh: export: %s: bad variable name\n", *args);
+            ret = -1;
+        } else if (eq) {
+            *eq = 0;
+            env_set(env, *args, eq + 1);
+        }
+        // without a value every variable is already exported
+    }
+    return ret;
+}
+
+// priority interactive|batch, or show the class of the session
+int builtin_priority(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    char **args = cmd->seq[0] + 1;
+    if (!args[0]) {
+        client_printf(epollfd, clientsock, "%s\n", client->batch ? "batch" : "interactive");
+        return 0;
+    }
+    if (args[1] || (strcmp(args[0], "interactive") && strcmp(args[0], "batch"))) {
+        client_printf(epollfd, clientsock, "usage: priority [interactive|batch]\n");
+        return -1;
+    }
+    // pipelines already running keep their class
+    client->batch = !strcmp(args[0], "batch");
+    return 0;
+}
+
+// limit NAME VALUE, or show the cgroup limits of pipelines started from now on
+int builtin_limit(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    unsh_cglimits *limits = &client_cgroup(clientsock)->limits;
+    char **args = cmd->seq[0] + 1;
+    if (!args[0]) {
+        client_printf(epollfd, clientsock, "cpu.weight %s\nmemory.max %s\npids.max %s\n",
+            limits->cpu_weight, limits->memory_max, limits->pids_max);
+        if (!cgroup_enabled()) {
+            client_printf(epollfd, clientsock, "unsh: limit: cgroups are not available, limits are not applied\n");
+        }
+        return 0;
+    }
+    if (!cgroup_limit_field(limits, args[0], NULL)) {
+        client_printf(epollfd, clientsock, "unsh: limit: %s: unknown limit\n", args[0]);
+        return -1;
+    }
+    if (!args[1]) {
+        client_printf(epollfd, clientsock, "%s %s\n", args[0], cgroup_limit_field(limits, args[0], NULL));
+        return 0;
+    }
+    char *field = cgroup_limit_field(limits, args[0], args[1]);
+    if (!field || args[2]) {
+        client_printf(epollfd, clientsock, "unsh: limit: %s: bad value\n", args[1]);
+        return -1;
+    }
+    strcpy(field, args[1]);
+    return 0;
+}
+
+int builtin_unset(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    int ret = 0;
+    for (char **args = cmd->seq[0] + 1; *args; args++) {
+        if (!env_valid_name(*args, strlen(*args))) {
+            client_printf(epollfd, clientsock, "unsh: unset: %s: bad variable name\n", *args);
+            ret = -1;
+        } else {
+            env_unset(&clientsock->sockaff.client.env, *args);
+        }
+    }
+    return ret;
+}
+
+int builtin_framed(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    (void)epollfd;
+    (void)cmd;
+    clientsock->sockaff.client.framed = true;
+    return 0;
+}
+
+int builtin_compress(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    (void)cmd;
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    if (!client->framed) {
+        client_printf(epollfd, clientsock, "unsh: compress needs framed mode\n");
+        return -1;
+    }
+    if (!client->zout && !(client->zout = zout_new())) {
+        client_printf(epollfd, clientsock, "unsh: cannot set up compression\n");
+        return -1;
+    }
+    return 0;
+}
+
+int builtin_stats(int epollfd, unsh_socket *clientsock, struct cmdline *cmd) {
+    (void)cmd;
+    unsh_chunk *chunk = chunk_new(UNSH_BUFSIZE);
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    chunk->len = stats_format(chunk->data, UNSH_BUFSIZE);
+    chunk->len += stats_printf(chunk->data + chunk->len, UNSH_BUFSIZE - chunk->len, "cgroup.enabled %d\n", cgroup_enabled());
+    chunk->len += stats_printf(chunk->data + chunk->len, UNSH_BUFSIZE - chunk->len, "session.priority %s\n", client->batch ? "batch" : "interactive");
+    if (client->zout) {
+        chunk->len += zout_format(client->zout, chunk->data + chunk->len, UNSH_BUFSIZE - chunk->len);
+    }
+    if (client->cgroup && client->cgroup->haslast) {
+        const unsh_cgusage *last = &client->cgroup->last;
+        chunk->len += stats_printf(chunk->data + chunk->len, UNSH_BUFSIZE - chunk->len,
+            "session.last.cpu_us %llu\n"
+            "session.last.user_us %llu\n"
+            "session.last.system_us %llu\n"
+            "session.last.memory_peak %llu\n",
+            last->usage_us, last->user_us, last->system_us, last->memory_peak);
+    }
+    client_send(epollfd, clientsock, chunk);
+    chunk_unref(chunk);
+    return 0;
+}
+
+typedef int (*unsh_builtin_fn)(int epollfd, unsh_socket *clientsock, struct cmdline *cmd);
+
+static const struct {
+    const char *name;
+    unsh_builtin_fn fn;
+} builtins[] = {
+    {"share", builtin_share},
+    {"attach", builtin_attach},
+    {"stats", builtin_stats},
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"kill", builtin_kill},
+    {"framed", builtin_framed},
+    {"compress", builtin_compress},
+    {"get", builtin_get},
+    {"put", builtin_put},
+    {"size", builtin_size},
+    {"export", builtin_export},
+    {"unset", builtin_unset},
+    {"limit", builtin_limit},
+    {"priority", builtin_priority},
+};
+
+// returns true if the command line was handled by a builtin
+bool run_builtin(int epollfd, unsh_socket *clientsock, struct cmdline *cmd, int *status) {
+    if (!cmd->seq || !cmd->seq[0]) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (!strcmp(cmd->seq[0][0], builtins[i].name)) {
+            *status = builtins[i].fn(epollfd, clientsock, cmd) ? 1 : 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void client_run_line(int epollfd, unsh_socket *sockdt, char *line) {
+    int status = 0;
+    UNSH_TRACE_BEGIN(TRACE_PARSE, sockdt->fd);
+    struct cmdline *cmd = readcmd(line, env_vars(&sockdt->sockaff.client.env));
+    UNSH_TRACE_END(TRACE_PARSE, sockdt->fd);
+    record_command(sockdt->sockaff.client.rec, line, cmd);
+    if (cmd->err) {
+        client_printf(epollfd, sockdt, "unsh: %s\n", cmd->err);
+        status = 2;
+    } else if (!run_builtin(epollfd, sockdt, cmd, &status)) {
+        UNSH_TRACE_BEGIN(TRACE_SPAWN, sockdt->fd);
+        status = spawn_start(epollfd, sockdt, cmd, NULL);
+        UNSH_TRACE_END(TRACE_SPAWN, sockdt->fd);
+    }
+    // otherwise done once the foreground job, the wait, the attached pipeline or the helpers are over
+    if (sockdt->sockaff.client.state == CLIENTSTATE_COMMAND) {
+        client_command_done(epollfd, sockdt, status);
+    }
+}
+
+// run the line received in linebuf, the buffer goes back to the pool
+void client_run_linebuf(int epollfd, unsh_socket *sockdt) {
+    unsh_sockaff_client *client = &sockdt->sockaff.client;
+    char *line = client->linebuf;
+    line[client->linelen] = 0;
+    client->linebuf = NULL;
+    client->linelen = 0;
+    client_run_line(epollfd, sockdt, line);
+    linebuf_put(line);
+}
+
+// how much a read handler did this turn: the bytes read, one more for the EOF, or -1 on error
+ssize_t read_progress(ssize_t thisread, size_t total) {
+    if (thisread == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+    }
+    return thisread == 0 ? total + 1 : total;
+}
+
+// framed mode: commands, input and end of input arrive as frames
+ssize_t handle_client_read_framed(int epollfd, unsh_socket *sockdt) {
+    int fd = sockdt->fd;
+    unsh_sockaff_client *client = &sockdt->sockaff.client;
+    ssize_t thisread = 1;
+    size_t total = 0;
+
+    while (!sockdt->dead && client_wants_input(client)) {
+        if (client->framehdrlen < UNSH_FRAME_HDRLEN) {
+            thisread = read(fd, client->framehdr + client->framehdrlen, UNSH_FRAME_HDRLEN - client->framehdrlen);
+            if (thisread <= 0) {
+                break;
+            }
+            total += thisread;
+            client->framehdrlen += thisread;
+            if (client->framehdrlen < UNSH_FRAME_HDRLEN) {
+                continue;
+            }
+            client->frameleft = unsh_frame_len(client->framehdr);
+            if (client->framehdr[0] == UNSH_FRAME_CMD) {
+                if (client->frameleft > UNSH_LINE_MAX) {
+                    fprintf(stderr, "command frame too long\n");
+                    client_close(epollfd, sockdt);
+                    return -1;
+                }
+                client->linebuf = linebuf_get();
+                client->linelen = 0;
+            }
             continue;
         }
 
-        for (int ei = 0; ei < pending; ei++) {
-            uint32_t evcode = events[ei].events;
-            unsh_socket *sockdt = events[ei].data.ptr;
+        unsh_frametype type = client->framehdr[0];
+        if (type == UNSH_FRAME_CMD) {
+            if (client->frameleft) {
+                thisread = read(fd, client->linebuf + client->linelen, client->frameleft);
+                if (thisread <= 0) {
+                    break;
+                }
+                total += thisread;
+                client->linelen += thisread;
+                client->frameleft -= thisread;
+                if (client->frameleft) {
+                    continue;
+                }
+            }
+            client->framehdrlen = 0;
+            client_run_linebuf(epollfd, sockdt);
 
-            if (evcode & EPOLLERR) {
-                fprintf(stderr, "oops\n");
-                int sockerr;
-                size_t sockerrsize = sizeof(int);
-                if (getsockopt(sockdt->fd, SOL_SOCKET, SO_ERROR, &sockerr, (socklen_t *)&sockerrsize) == 0) {
-                    error(0, sockerr, "fd error");
+        } else if (type == UNSH_FRAME_DATA && client->state == CLIENTSTATE_PUT) {
+            if (client->frameleft) {
+                thisread = xfer_recv(client->xfer, fd, client->frameleft);
+                if (thisread <= 0) {
+                    break;
                 }
-                if (sockdt->fd == sockfd) {
-                    fprintf(stderr, "socket fd encountered unexpected error, quitting\n");
-                    return 1;
+                total += thisread;
+                client_record_io(sockdt, thisread, 0);
+                client->frameleft -= thisread;
+            }
+            if (!client->frameleft) {
+                client->framehdrlen = 0;
+            }
+
+        } else if (type == UNSH_FRAME_DATA) {
+            if (client->frameleft) {
+                size_t size = client->frameleft < UNSH_BUFSIZE ? client->frameleft : UNSH_BUFSIZE;
+                unsh_chunk *chunk = chunk_new(size);
+                thisread = read(fd, chunk->data, size);
+                if (thisread <= 0) {
+                    chunk_unref(chunk);
+                    break;
                 }
-                epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL);
-                close(sockdt->fd);
-                continue;
+                total += thisread;
+                chunk->len = thisread;
+                client->frameleft -= thisread;
+                // input arriving after the job is over is dropped
+                if (client->state == CLIENTSTATE_INPUT) {
+                    client_stdin_send(epollfd, sockdt, chunk);
+                }
+                chunk_unref(chunk);
+            }
+            if (!client->frameleft) {
+                client->framehdrlen = 0;
+            }
+
+        } else if (type == UNSH_FRAME_EOF && !client->frameleft) {
+            client->framehdrlen = 0;
+            if (client->state == CLIENTSTATE_INPUT) {
+                client_stdin_close(epollfd, sockdt);
+            } else if (client->state == CLIENTSTATE_PUT) {
+                client_xfer_done(epollfd, sockdt);
+            }
+
+        } else {
+            fprintf(stderr, "bad frame type %d\n", type);
+            client_close(epollfd, sockdt);
+            return -1;
+        }
+    }
+
+    ssize_t ret = read_progress(thisread, total);
+    if (thisread == 0) {
+        client_input_eof(epollfd, sockdt);
+    } else if (!sockdt->dead) {
+        // if the loop stopped for the client's state, EPOLLIN is dropped, taking it back reports what is left
+        client_update_events(epollfd, sockdt);
+    }
+    return ret;
+}
+
+ssize_t client_read(int epollfd, unsh_socket *sockdt) {
+    int fd = sockdt->fd;
+    unsh_sockaff_client *client = &sockdt->sockaff.client;
+
+    if (client->framed) {
+        return handle_client_read_framed(epollfd, sockdt);
+
+    } else if (client->state == CLIENTSTATE_COMMAND) {
+        ssize_t thisread;
+        size_t total = 0;
+        bool more = false;
+        if (!client->linebuf) {
+            client->linebuf = linebuf_get();
+        }
+        char *lineptr = client->linebuf + client->linelen;
+        while ((thisread = read(fd, lineptr, 1)) > 0) {
+            char readed = *(char *)lineptr;
+            total++;
+            if (client->linelen >= UNSH_LINE_MAX - 1) {
+                client->linelen = 0;
+                lineptr = client->linebuf;
+            } else if (readed == '\r' || readed == '\n') {
+                client_run_linebuf(epollfd, sockdt);
+                more = true;
+                break;
+            } else {
+                client->linelen++;
+                lineptr++;
+            }
+        }
+        // nothing pending, do not keep a buffer for an idle client
+        if (client->linebuf && !client->linelen) {
+            linebuf_put(client->linebuf);
+            client->linebuf = NULL;
+        }
+        if (thisread == 0) {
+            client_input_eof(epollfd, sockdt);
+        }
+        // what follows the line is read on another turn, or once the command lets it
+        if (more && !sockdt->dead) {
+            client_update_events(epollfd, sockdt);
+            if (client_wants_input(client)) {
+                sock_requeue(sockdt, EPOLLIN);
+            }
+        }
+        return read_progress(thisread, total);
+
+    } else if (client->state == CLIENTSTATE_INPUT) {
+        // read from client socket and pump it to child stdin
+        ssize_t thisread = 0;
+        size_t total = 0;
+        while (client->state == CLIENTSTATE_INPUT && !client->inq.head) {
+            unsh_chunk *chunk = chunk_new(UNSH_BUFSIZE);
+            thisread = read(fd, chunk->data, UNSH_BUFSIZE);
+            if (thisread <= 0) {
+                chunk_unref(chunk);
+                break;
+            }
+            total += thisread;
+            chunk->len = thisread;
+            client_stdin_send(epollfd, sockdt, chunk);
+            chunk_unref(chunk);
+        }
+        if (thisread == 0) {
+            client_input_eof(epollfd, sockdt);
+        }
+        return read_progress(thisread, total);
+
+    } else if (client->state == CLIENTSTATE_SPAWNING || client->state == CLIENTSTATE_GET) {
+        // input is left in the socket until the pipeline is running, or the file is sent
+        return 0;
+
+    } else if (client->state == CLIENTSTATE_PUT) {
+        ssize_t thisread;
+        size_t total = 0;
+        while ((thisread = xfer_recv(client->xfer, fd, UNSH_PIPE_SIZE)) > 0) {
+            total += thisread;
+            client_record_io(sockdt, thisread, 0);
+        }
+        if (thisread == 0) {
+            // without frames, the file ends with the input
+            client_xfer_done(epollfd, sockdt);
+            client_input_eof(epollfd, sockdt);
+        }
+        return read_progress(thisread, total);
+
+    } else if (client->state == CLIENTSTATE_ATTACHED) {
+        // watchers only receive output, their input is discarded
+        ssize_t thisread;
+        size_t total = 0;
+        char buf[UNSH_BUFSIZE];
+        while ((thisread = read(fd, buf, UNSH_BUFSIZE)) > 0) {
+            total += thisread;
+        }
+        if (thisread == 0) {
+            client_input_eof(epollfd, sockdt);
+        }
+        return read_progress(thisread, total);
 
-            } else if (sockdt->fd == sockfd) {
-                while (1) {
-                    struct sockaddr_in ca;
-                    socklen_t clen = sizeof(struct sockaddr_in);
-                    int newfd = accept4(sockfd, (struct sockaddr *)&ca, &clen, SOCK_NONBLOCK);
-                    if (newfd < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            // no connections waiting for accept
-                            break;
-                        } else {
-                            perror("error accepting connection");
-                        }
-                    } else {
-                        struct epoll_event copts = {0};
-                        copts.events = EPOLLIN | EPOLLRDHUP;
-                        copts.data.ptr = newsock(newfd, (unsh_sockettype)SOCKETTYPE_CLIENT, true);
-                        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newfd, &copts) != 0) {
-                            perror("cannot set fd events");
-                            close(newfd);
-                        }
-                    }
+    } else {
+        fprintf(stderr, "unknown client state");
+        return -1;
+    }
+}
+
+ssize_t handle_client_read(int epollfd, unsh_socket *sockdt) {
+    UNSH_TRACE_BEGIN(TRACE_CLIENT_READ, sockdt->fd);
+    ssize_t ret = client_read(epollfd, sockdt);
+    // sockets are only freed after the batch
+    UNSH_TRACE_END(TRACE_CLIENT_READ, sockdt->fd);
+    return ret;
+}
+
+ssize_t handle_client_in(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    if (events & EPOLLHUP) {
+        client_close(epollfd, sockdt);
+        return 1;
+    }
+    if (events & EPOLLRDHUP) {
+        // only the sending side is closed, pending input and the EOF are still to be read
+        sockdt->sockaff.client.rdhup = true;
+        client_update_events(epollfd, sockdt);
+        if (!(events & EPOLLIN)) {
+            return 1;
+        }
+    }
+    return handle_client_read(epollfd, sockdt);
+}
+
+ssize_t handle_client_write(int epollfd, unsh_socket *sockdt) {
+    unsh_sockaff_client *client = &sockdt->sockaff.client;
+    ssize_t thiswrite = 0;
+    UNSH_TRACE_BEGIN(TRACE_CLIENT_WRITE, sockdt->fd);
+    if (client->state == CLIENTSTATE_GET) {
+        // also flushes the queue between frames
+        thiswrite = client_get_pump(epollfd, sockdt);
+    } else {
+        thiswrite = outq_flush(&client->outq, sockdt->fd);
+    }
+    UNSH_TRACE_END(TRACE_CLIENT_WRITE, sockdt->fd);
+    if (sockdt->dead) {
+        return 1;
+    }
+    if (thiswrite < 0) {
+        // the client is gone, epoll will report the hangup
+        outq_clear(&client->outq);
+    }
+    client_update_events(epollfd, sockdt);
+    client_check_finished(epollfd, sockdt);
+    if (sockdt->dead) {
+        return 1;
+    }
+
+    if (client->outq.bytes <= UNSH_OUTQ_LOW) {
+        for (unsh_job *job = client->jobs; job; job = job->next) {
+            if (job->posock && job->posock->sockaff.proc_out.paused) {
+                proc_out_resume(epollfd, job->posock);
+            }
+        }
+    }
+    return thiswrite;
+}
+
+ssize_t handle_proc_in_write(int epollfd, unsh_socket *sockdt) {
+    unsh_socket *clientsock = sockdt->sockaff.proc_in.clientsock;
+    unsh_sockaff_client *client = &clientsock->sockaff.client;
+    ssize_t thiswrite = outq_flush(&client->inq, sockdt->fd);
+    if (thiswrite < 0) {
+        // the job closed its input
+        client_stdin_close(epollfd, clientsock);
+    } else if (!client->inq.head) {
+        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL) != 0) {
+            perror("error unsetting proc_in fd events");
+        }
+        sockdt->sockaff.proc_in.polling = false;
+    }
+    client_update_events(epollfd, clientsock);
+    return thiswrite;
+}
+
+// a hangup is only acted on at the EOF, after the output left in the pipe
+ssize_t handle_proc_out_read(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    assert(sockdt->socktype == SOCKETTYPE_PROC_OUT);
+    (void)events;
+
+    unsh_sockaff_proc_out *po = &sockdt->sockaff.proc_out;
+    int fd = sockdt->fd;
+    // not 0, which would be the EOF, if paused from the start
+    ssize_t thisread = 1;
+    // the rest waits for the next round, so that a busy pipeline cannot starve other sockets
+    size_t budget = po->batch ? UNSH_BATCH_RELAY_BUDGET : UNSH_RELAY_BUDGET;
+    size_t relayed = 0;
+    // a short read emptied the pipe, the next write of the pipeline is a new edge
+    bool drained = false;
+    UNSH_TRACE_BEGIN(TRACE_PROC_OUT_READ, fd);
+    // a framed watcher lagging behind may take the last subscriber, and the pipeline, with it
+    while (!sockdt->dead && !po->paused && relayed < budget) {
+        int avail;
+        if (ioctl(fd, FIONREAD, &avail) < 0) {
+            avail = 0;
+        }
+        // a full tail pipe means the pipeline was blocked on us, give it more room
+        if (avail >= po->pipesize) {
+            po->pipesize = pipe_grow(fd, po->pipesize);
+        }
+        // take everything that is pending in one read
+        size_t size = avail > UNSH_BUFSIZE ? (size_t)avail : UNSH_BUFSIZE;
+        unsh_chunk *chunk = chunk_new(size);
+        thisread = read(fd, chunk->data, size);
+        if (thisread <= 0) {
+            chunk_unref(chunk);
+            break;
+        }
+        chunk->len = thisread;
+        relayed += thisread;
+        drained = (size_t)thisread < size;
+        proc_out_broadcast(epollfd, sockdt, chunk);
+        chunk_unref(chunk);
+    }
+    UNSH_TRACE_END(TRACE_PROC_OUT_READ, fd);
+    ssize_t ret = read_progress(thisread, relayed);
+    if (sockdt->dead) {
+        return ret;
+    }
+    if (thisread == 0) {
+        // pipeline output is done
+        proc_out_close(epollfd, sockdt);
+    } else if (relayed >= budget && !po->paused && !drained) {
+        sock_requeue(sockdt, EPOLLIN);
+    }
+    // if paused, resuming reports what is left
+    return ret;
+}
+
+// returns the connections accepted
+ssize_t handle_server_accept(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    (void)events;
+    ssize_t accepted = 0;
+    while (1) {
+        int newfd = accept4(sockdt->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newfd < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (!accept_starved) {
+                    perror("error accepting connection");
                 }
+                accept_starved = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // the next connection may still be fine
+                perror("error accepting connection");
+                sock_requeue(sockdt, EPOLLIN);
+            }
+            // otherwise no connections waiting for accept
+            break;
+        }
+        struct epoll_event copts = {0};
+        copts.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        unsh_socket *clientsock = newsock(newfd, (unsh_sockettype)SOCKETTYPE_CLIENT, true);
+        copts.data.ptr = clientsock;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newfd, &copts) != 0) {
+            perror("cannot set fd events");
+            close(newfd);
+            freesock(clientsock);
+        } else {
+            clientsock->sockaff.client.rec = record_session_new();
+            nclients++;
+            accepted++;
+        }
+    }
+    return accepted;
+}
 
-            } else if (sockdt->fd == sigfd) {
-                struct signalfd_siginfo siginfo;
-                while (read(sigfd, &siginfo, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo)) {
-                    if (siginfo.ssi_signo == SIGCHLD) {
-                        while (waitpid(-1, NULL, WNOHANG) > 0);
-                    }
+// returns the signals handled
+ssize_t handle_signal_read(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    (void)events;
+    ssize_t nsignals = 0;
+    struct signalfd_siginfo siginfo;
+    while (read(sockdt->fd, &siginfo, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo)) {
+        nsignals++;
+        if (siginfo.ssi_signo == SIGCHLD) {
+            UNSH_TRACE_BEGIN(TRACE_SIGCHLD, 0);
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                UNSH_TRACE_INSTANT(TRACE_REAP, pid);
+                unsh_job *job = job_reap(pid, status);
+                if (job) {
+                    job_check_done(epollfd, job);
                 }
+            }
+            UNSH_TRACE_END(TRACE_SIGCHLD, 0);
+        }
+        if (siginfo.ssi_signo == SIGHUP && !handoffsock && !draining) {
+            // graceful restart: a new unshd takes over the listeners, we finish our sessions
+            int chanfd = handoff_start(restart_argv, listenfds, nlisten);
+            if (chanfd >= 0) {
+                struct epoll_event hoopts = {0};
+                hoopts.events = EPOLLIN | EPOLLET;
+                hoopts.data.ptr = handoffsock = newsock(chanfd, SOCKETTYPE_HANDOFF, true);
+                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, chanfd, &hoopts) != 0) {
+                    perror("cannot set handoff events");
+                    close(chanfd);
+                    freesock(handoffsock);
+                    handoffsock = NULL;
+                }
+            }
+        }
+        if (siginfo.ssi_signo == SIGTERM || siginfo.ssi_signo == SIGINT) {
+            quitting = true;
+        }
+#ifdef UNSH_TRACE
+        if (siginfo.ssi_signo == SIGUSR2) {
+            char path[64];
+            snprintf(path, sizeof(path), UNSH_TRACE_FILE, (int)getpid());
+            if (trace_dump(path) == 0) {
+                fprintf(stderr, "trace written to %s\n", path);
+            }
+        }
+#endif
+    }
+    return nsignals;
+}
 
-            } else if (evcode & EPOLLHUP || evcode & EPOLLRDHUP) {
-                if (sockdt->socktype == SOCKETTYPE_CLIENT) {
-                    if (sockdt->sockaff.client.writeinfd >= 0) {
-                        if (close(sockdt->sockaff.client.writeinfd) != 0) {
-                            perror("error closing writeinfd");
-                        }
-                    }
-                    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL) != 0) {
-                        perror("error unsetting client fd events");
-                    }
-                    if (close(sockdt->fd) != 0) {
-                        perror("error closing client fd");
-                    }
-                    if (sockdt->sockaff.client.haspipe) {
-                        sockdt->sockaff.client.state = CLIENTSTATE_CLOSED;
-                    } else {
-                        freesock(sockdt);
-                    }
-
-                } else if (sockdt->socktype == SOCKETTYPE_PROC_OUT) {
-                    // pipeline output is done
-                    unsh_socket *clientsock = sockdt->sockaff.proc_out.clientsock;
-                    assert(clientsock->socktype == SOCKETTYPE_CLIENT);
-
-                    if (clientsock->sockaff.client.state == CLIENTSTATE_CLOSED) {
-                        freesock(clientsock);
-                    } else {
-                        // flush pipeline output to client first
-                        handle_proc_out_read(sockdt);
-                        clientsock->sockaff.client.state = CLIENTSTATE_COMMAND;
-                        clientsock->sockaff.client.haspipe = false;
-                    }
-
-                    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL) != 0) {
-                        perror("error unsetting proc_out fd events");
-                    }
-                    if (close(sockdt->fd) != 0) {
-                        perror("error closing proc_out fd");
-                    }
-                    freesock(sockdt);
+ssize_t handle_inotify_read(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    (void)epollfd;
+    (void)sockdt;
+    (void)events;
+    pathcache_handle_events();
+    return 1;
+}
 
-                } else {
-                    fprintf(stderr, "rogue socket type %s\n", unsh_sockettype_strings[sockdt->socktype]);
-                    assert(0);
+ssize_t handle_offload_read(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    (void)sockdt;
+    (void)events;
+    offload_complete(epollfd);
+    return 1;
+}
+
+// the new unshd is serving, or gave up
+ssize_t handle_handoff_read(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    (void)events;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL);
+    retiresock(sockdt);
+    handoffsock = NULL;
+    if (handoff_finish(sockdt->fd) == 0) {
+        // both of us accepted until now, so no connection was refused
+        for (int i = 0; i < nlisten; i++) {
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfds[i], NULL);
+            close(listenfds[i]);
+            retiresock(listensocks[i]);
+        }
+        draining = true;
+        fprintf(stderr, "handed over to the new unshd, %d clients left\n", nclients);
+    } else {
+        fprintf(stderr, "new unshd did not start, still serving\n");
+    }
+    return 1;
+}
+
+void server_error(int epollfd, unsh_socket *sockdt) {
+    (void)epollfd;
+    (void)sockdt;
+    fprintf(stderr, "socket fd encountered unexpected error, quitting\n");
+    exit(1);
+}
+
+void proc_in_error(int epollfd, unsh_socket *sockdt) {
+    // the job closed its input
+    unsh_socket *clientsock = sockdt->sockaff.proc_in.clientsock;
+    client_stdin_close(epollfd, clientsock);
+    client_update_events(epollfd, clientsock);
+}
+
+void fd_error(int epollfd, unsh_socket *sockdt) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL);
+    close(sockdt->fd);
+    retiresock(sockdt);
+}
+
+// what each type of socket does with its events
+// in and out return how much they did, 0 being a wasted wakeup
+// they run up to EAGAIN, or queue their socket with sock_requeue if they stop before
+typedef struct unsh_handler {
+    // readable or hung up
+    ssize_t (*in)(int epollfd, unsh_socket *sockdt, uint32_t events);
+    // writable
+    ssize_t (*out)(int epollfd, unsh_socket *sockdt);
+    // EPOLLERR, NULL to handle it as a hangup
+    void (*err)(int epollfd, unsh_socket *sockdt);
+} unsh_handler;
+
+static const unsh_handler handlers[] = {
+    [SOCKETTYPE_SERVER] = {handle_server_accept, NULL, server_error},
+    [SOCKETTYPE_CLIENT] = {handle_client_in, handle_client_write, client_close},
+    [SOCKETTYPE_PROC_IN] = {NULL, handle_proc_in_write, proc_in_error},
+    [SOCKETTYPE_PROC_OUT] = {handle_proc_out_read, NULL, proc_out_close},
+    [SOCKETTYPE_SIGNAL] = {handle_signal_read, NULL, fd_error},
+    [SOCKETTYPE_INOTIFY] = {handle_inotify_read, NULL, fd_error},
+    [SOCKETTYPE_OFFLOAD] = {handle_offload_read, NULL, fd_error},
+    // a failed handoff is reported like a refused one
+    [SOCKETTYPE_HANDOFF] = {handle_handoff_read, NULL, NULL},
+};
+
+void dispatch(int epollfd, unsh_socket *sockdt, uint32_t events) {
+    const unsh_handler *h = &handlers[sockdt->socktype];
+    stats.loop_events++;
+
+    if (events & EPOLLERR && h->err) {
+        int sockerr;
+        socklen_t sockerrsize = sizeof(int);
+        if (getsockopt(sockdt->fd, SOL_SOCKET, SO_ERROR, &sockerr, &sockerrsize) == 0) {
+            error(0, sockerr, "fd error");
+        }
+        h->err(epollfd, sockdt);
+        return;
+    }
+
+    bool worked = false;
+    if (events & EPOLLOUT && h->out) {
+        worked |= h->out(epollfd, sockdt) != 0;
+    }
+    if (events & ~EPOLLOUT && h->in && !sockdt->dead) {
+        worked |= h->in(epollfd, sockdt, events) != 0;
+    }
+    if (!worked) {
+        stats.loop_wasted++;
+    }
+}
+
+bool sock_is_batch(unsh_socket *sock) {
+    switch (sock->socktype) {
+        case SOCKETTYPE_CLIENT:
+            return sock->sockaff.client.batch;
+        case SOCKETTYPE_PROC_IN:
+            return sock->sockaff.proc_in.clientsock->sockaff.client.batch;
+        case SOCKETTYPE_PROC_OUT:
+            return sock->sockaff.proc_out.batch;
+        default:
+            return false;
+    }
+}
+
+// the turns asked for with sock_requeue, interactive sessions first like the events
+void serve_requeued(int epollfd, unsh_socket *requeued) {
+    unsh_socket *lists[2] = {NULL, NULL};
+    unsh_socket **tails[2] = {&lists[0], &lists[1]};
+    unsh_socket *next;
+    for (unsh_socket *sock = requeued; sock; sock = next) {
+        next = sock->nextready;
+        int batch = !sock->dead && sock_is_batch(sock);
+        sock->nextready = NULL;
+        *tails[batch] = sock;
+        tails[batch] = &sock->nextready;
+    }
+    for (int batch = 0; batch < 2; batch++) {
+        for (unsh_socket *sock = lists[batch]; sock; sock = next) {
+            next = sock->nextready;
+            uint32_t events = sock->readyevents;
+            // from here on it can be queued again, for the next round
+            sock->readyevents = 0;
+            sock->nextready = NULL;
+            if (!sock->dead) {
+                stats.loop_requeued++;
+                dispatch(epollfd, sock, events);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    // argv is kept as is, a restart runs it again
+    restart_argv = argv;
+    bool cgroups = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "gr:")) != -1) {
+        switch (opt) {
+            case 'g':
+                // one cgroup per pipeline, see cgroup.h
+                cgroups = true;
+                break;
+            case 'r':
+                // record sessions for unshreplay
+                if (record_open(optarg) < 0) {
+                    return 1;
                 }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-g] [-r RECORDFILE]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "usage: %s [-g] [-r RECORDFILE]\n", argv[0]);
+        return 1;
+    }
 
-            } else if (evcode & EPOLLIN) {
-                if (sockdt->socktype == SOCKETTYPE_CLIENT) {
-                    handle_client_read(epollfd, sockdt);
+    sigset_t chs;
+    if (sigemptyset(&chs) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+    if (sigaddset(&chs, SIGCHLD) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+    // graceful restart request
+    if (sigaddset(&chs, SIGHUP) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+    // stop requests, handled so that the session record is written out and our cgroups removed
+    if (sigaddset(&chs, SIGTERM) != 0 || sigaddset(&chs, SIGINT) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+#ifdef UNSH_TRACE
+    // trace dump request
+    if (sigaddset(&chs, SIGUSR2) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+#endif
+    if (sigprocmask(SIG_BLOCK, &chs, NULL) != 0) {
+        perror("cannot mask signals");
+        return 1;
+    }
+
+    int sigfd = signalfd(-1, &chs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        perror("error registering signalfd");
+        return 1;
+    }
+
+    if (sigaddset(&chs, SIGPIPE) != 0) {
+        perror("cannot initialize signal set");
+        return 1;
+    }
+    if (sigprocmask(SIG_BLOCK, &chs, NULL) != 0) {
+        perror("cannot mask signals");
+        return 1;
+    }
 
-                } else if (sockdt->socktype == SOCKETTYPE_PROC_IN) {
+    // listeners from a supervisor or from the unshd we replace, otherwise our own
+    nlisten = handoff_listen_fds(listenfds, UNSH_LISTEN_MAX);
+    if (nlisten < 0) {
+        return 1;
+    }
 
-                } else if (sockdt->socktype == SOCKETTYPE_PROC_OUT) {
-                    unsh_socket *clientsock = sockdt->sockaff.proc_out.clientsock;
-                    if (clientsock->sockaff.client.state != CLIENTSTATE_CLOSED) {
-                        handle_proc_out_read(sockdt);
-                    } else {
-                        epoll_ctl(epollfd, EPOLL_CTL_DEL, sockdt->fd, NULL);
-                        close(sockdt->fd);
-                        freesock(sockdt);
-                    }
+    if (!nlisten) {
+        int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+            perror("error creating sockfd");
+            return 1;
+        }
 
-                } else {
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) != 0) {
+            perror("error setting SO_REUSEADDR");
+            return 1;
+        }
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(struct sockaddr_in));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        sa.sin_port = htons(UNSH_PORT);
+
+        if (bind(sockfd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0) {
+            perror("error binding");
+            return 1;
+        }
+
+        if (listen(sockfd, SOMAXCONN) < 0) {
+            perror("error listening");
+            return 1;
+        }
+        listenfds[nlisten++] = sockfd;
+    }
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd <= 0) {
+        perror("error creating epoll");
+        return 1;
+    }
+
+    // room for the largest batch, see maxevents below
+    struct epoll_event *events = malloc(UNSH_MAXEVENTS * sizeof(struct epoll_event));
+    int *order = malloc(UNSH_MAXEVENTS * sizeof(int));
+
+    // register server sockets gives us accept() notifications
+    for (int i = 0; i < nlisten; i++) {
+        struct epoll_event ssopts = {0};
+        ssopts.events = EPOLLIN | EPOLLET;
+        ssopts.data.ptr = listensocks[i] = newsock(listenfds[i], SOCKETTYPE_SERVER, true);
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfds[i], &ssopts) != 0) {
+            perror("cannot set sockfd events");
+            return 1;
+        }
+    }
+
+    // register signalfd
+    struct epoll_event sigopts = {0};
+    sigopts.events = EPOLLIN | EPOLLET;
+    sigopts.data.ptr = newsock(sigfd, SOCKETTYPE_SIGNAL, true);
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sigfd, &sigopts) != 0) {
+        perror("cannot set sigfd events");
+        return 1;
+    }
+
+    // register PATH watches, the cache still works uncached without them
+    int inotifyfd = pathcache_init();
+    if (inotifyfd >= 0) {
+        struct epoll_event inopts = {0};
+        inopts.events = EPOLLIN | EPOLLET;
+        inopts.data.ptr = newsock(inotifyfd, SOCKETTYPE_INOTIFY, true);
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, inotifyfd, &inopts) != 0) {
+            perror("cannot set inotifyfd events");
+            return 1;
+        }
+    }
+
+    // before the helpers start, so that the whole daemon moves to its cgroup
+    if (cgroups) {
+        cgroup_init();
+    }
+
+    // start the helpers for blocking filesystem work
+    int offloadfd = offload_init();
+    if (offloadfd < 0) {
+        return 1;
+    }
+    struct epoll_event ofopts = {0};
+    ofopts.events = EPOLLIN | EPOLLET;
+    ofopts.data.ptr = newsock(offloadfd, SOCKETTYPE_OFFLOAD, true);
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, offloadfd, &ofopts) != 0) {
+        perror("cannot set offload events");
+        return 1;
+    }
+
+    // serving from here on, the unshd we replace can stop accepting
+    handoff_ready();
+
+    // grown while batches come back full, shrunk back when the load is gone
+    int maxevents = UNSH_MINEVENTS;
+    while (1) {
+        stats.loop_batch = maxevents;
+        // queued sockets have work left, only collect what else is ready
+        int timeout = sock_ready_pending() ? 0 : -1;
+        UNSH_TRACE_BEGIN(TRACE_WAIT, 0);
+        int pending = epoll_wait(epollfd, events, maxevents, timeout);
+        UNSH_TRACE_END(TRACE_WAIT, pending);
+        if (pending < 0) {
+            perror("error waiting for new event");
+            continue;
+        }
+        UNSH_TRACE_BEGIN(TRACE_BATCH, pending);
+        stats.loop_rounds++;
+        // queued during the previous round, a pipeline that used up its budget gets time to refill
+        unsh_socket *requeued = sock_take_ready();
+
+        // interactive sessions first, batch ones get what is left of the round
+        int norder = 0;
+        for (int batch = 0; batch < 2; batch++) {
+            for (int ei = 0; ei < pending; ei++) {
+                if (sock_is_batch(events[ei].data.ptr) == batch) {
+                    order[norder++] = ei;
                 }
+            }
+        }
 
-            } else {
-                fprintf(stderr, "unknown event state\n");
+        for (int oi = 0; oi < pending; oi++) {
+            int ei = order[oi];
+            unsh_socket *sockdt = events[ei].data.ptr;
+            if (sockdt->dead) {
                 continue;
             }
+            dispatch(epollfd, sockdt, events[ei].events);
+        }
+        serve_requeued(epollfd, requeued);
+
+        if (pending == maxevents && maxevents < UNSH_MAXEVENTS) {
+            maxevents *= 2;
+        } else if (pending < maxevents / 4 && maxevents > UNSH_MINEVENTS) {
+            maxevents /= 2;
+        }
+
+        // no edge will report the connections left behind by EMFILE
+        if (reapsocks() && accept_starved && !draining) {
+            accept_starved = false;
+            for (int i = 0; i < nlisten; i++) {
+                sock_requeue(listensocks[i], EPOLLIN);
+            }
+        }
+        record_flush();
+        stats_loop_tick();
+        UNSH_TRACE_END(TRACE_BATCH, pending);
+
+        if (draining && !nclients) {
+            return 0;
+        }
+        if (quitting) {
+            // after a handoff the cgroups are our successor's
+            if (!draining) {
+                cgroup_cleanup();
+            }
+            return 0;
         }
     }
 }
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "libunsh.h"
+#include "record.h"
+
+// replay sessions recorded by "unshd -r" against an unshd, and compare latencies
+// the commands run for real, point this at a scratch host
+// input is replaced by as many filler bytes, sent at once, so commands waiting for a user finish sooner
+// each session runs its commands in order
+// but libunsh may send them over different connections, so session state such as exports is not kept
+
+typedef struct replay_cmd {
+    char *line;
+    // from the start of the recording
+    uint64_t ts;
+    // recorded, 0 if the session went away before the command was over
+    uint64_t latency;
+    int status;
+    uint64_t in;
+    uint64_t out;
+    // replay results
+    double drift_ms;
+    double latency_ms;
+    int rstatus;
+    uint64_t rout;
+    bool lost;
+} replay_cmd;
+
+typedef struct replay_session {
+    uint32_t pid;
+    uint32_t id;
+    replay_cmd *cmds;
+    size_t ncmds;
+    // next command to submit
+    size_t next;
+    unsh_cmd *cmd;
+    uint64_t inleft;
+    double started;
+} replay_session;
+
+typedef struct replay {
+    unsh_client *cl;
+    const char *host;
+    replay_session *sessions;
+    size_t nsessions;
+    // 0 for as fast as possible
+    double speed;
+    bool verbose;
+    double start;
+} replay;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static replay_session *find_session(replay *r, uint32_t pid, uint32_t id) {
+    // recent sessions are the busy ones
+    for (size_t i = r->nsessions; i > 0; i--) {
+        if (r->sessions[i - 1].pid == pid && r->sessions[i - 1].id == id) {
+            return &r->sessions[i - 1];
+        }
+    }
+    r->sessions = realloc(r->sessions, (r->nsessions + 1) * sizeof(replay_session));
+    replay_session *ret = &r->sessions[r->nsessions++];
+    memset(ret, 0, sizeof(*ret));
+    ret->pid = pid;
+    ret->id = id;
+    return ret;
+}
+
+// framing and compression are up to libunsh
+static bool skip_command(const char *line) {
+    return !strcmp(line, "'framed'") || !strcmp(line, "'compress'");
+}
+
+static int load(replay *r, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("cannot open record file");
+        return -1;
+    }
+    char magic[sizeof(UNSH_RECORD_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, UNSH_RECORD_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "not an unshd session record\n");
+        fclose(f);
+        return -1;
+    }
+
+    unsh_record_header hdr;
+    uint64_t t0 = 0;
+    bool first = true;
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        char *payload = malloc(hdr.len + 1);
+        if (fread(payload, 1, hdr.len, f) != hdr.len) {
+            fprintf(stderr, "truncated record, replaying what came before\n");
+            free(payload);
+            break;
+        }
+        payload[hdr.len] = 0;
+        if (first) {
+            t0 = hdr.ts;
+            first = false;
+        }
+        replay_session *s = find_session(r, hdr.pid, hdr.session);
+        replay_cmd *last = s->ncmds ? &s->cmds[s->ncmds - 1] : NULL;
+        if (hdr.type == RECORD_CMD && !skip_command(payload)) {
+            s->cmds = realloc(s->cmds, (s->ncmds + 1) * sizeof(replay_cmd));
+            replay_cmd *cmd = &s->cmds[s->ncmds++];
+            memset(cmd, 0, sizeof(*cmd));
+            cmd->line = payload;
+            // records of two unshd during a restart may be slightly out of order
+            cmd->ts = hdr.ts > t0 ? hdr.ts - t0 : 0;
+            continue;
+        } else if (hdr.type == RECORD_DONE && hdr.len == sizeof(unsh_record_done) && last && !last->latency) {
+            unsh_record_done done;
+            memcpy(&done, payload, sizeof(done));
+            last->latency = hdr.ts - t0 > last->ts ? hdr.ts - t0 - last->ts : 1;
+            last->status = done.status;
+            last->in = done.in;
+            last->out = done.out;
+        }
+        free(payload);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void replay_output(unsh_cmd *cmd, const char *data, size_t len, void *arg) {
+    (void)cmd;
+    (void)data;
+    replay_session *s = arg;
+    s->cmds[s->next].rout += len;
+}
+
+static void replay_done(unsh_cmd *cmd, int status, int error, void *arg) {
+    (void)cmd;
+    replay_session *s = arg;
+    replay_cmd *rc = &s->cmds[s->next++];
+    rc->latency_ms = now_ms() - s->started;
+    rc->rstatus = status;
+    rc->lost = error != 0;
+    s->cmd = NULL;
+    s->inleft = 0;
+}
+
+// filler input, sent while the connection keeps up
+static void replay_input(replay_session *s) {
+    static char filler[UNSH_BUFSIZE];
+    if (!filler[0]) {
+        memset(filler, 'x', sizeof(filler));
+        for (size_t i = 63; i < sizeof(filler); i += 64) {
+            filler[i] = '\n';
+        }
+    }
+    while (s->inleft && unsh_cmd_queued(s->cmd) < UNSH_XFER_WINDOW) {
+        size_t len = s->inleft < sizeof(filler) ? s->inleft : sizeof(filler);
+        if (unsh_cmd_write(s->cmd, filler, len) < 0) {
+            s->inleft = 0;
+            break;
+        }
+        s->inleft -= len;
+    }
+    if (!s->inleft) {
+        unsh_cmd_close_input(s->cmd);
+    }
+}
+
+// returns the time of the next command that is not due yet, or -1
+static double replay_submit(replay *r, replay_session *s, double now) {
+    while (!s->cmd && s->next < s->ncmds) {
+        replay_cmd *rc = &s->cmds[s->next];
+        double due = r->speed > 0 ? r->start + rc->ts / 1e6 / r->speed : now;
+        if (due > now) {
+            return due;
+        }
+        rc->drift_ms = now - due;
+        s->started = now;
+        s->cmd = unsh_submit(r->cl, r->host, rc->line, replay_output, replay_done, s);
+        if (!s->cmd) {
+            rc->lost = true;
+            s->next++;
+            continue;
+        }
+        s->inleft = rc->in;
+        replay_input(s);
+    }
+    return -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, size_t n, int p) {
+    if (!n) {
+        return 0;
+    }
+    size_t i = (n * p + 99) / 100;
+    return v[i ? i - 1 : 0];
+}
+
+static void report(replay *r) {
+    size_t ncmds = 0, nlost = 0, nstatus = 0, ncompared = 0;
+    uint64_t out = 0, rout = 0;
+    double span = 0;
+    for (size_t i = 0; i < r->nsessions; i++) {
+        ncmds += r->sessions[i].ncmds;
+    }
+    double *rec = malloc((ncmds + 1) * sizeof(double));
+    double *rep = malloc((ncmds + 1) * sizeof(double));
+    double *drift = malloc((ncmds + 1) * sizeof(double));
+    size_t ndrift = 0;
+    for (size_t i = 0; i < r->nsessions; i++) {
+        replay_session *s = &r->sessions[i];
+        for (size_t j = 0; j < s->ncmds; j++) {
+            replay_cmd *rc = &s->cmds[j];
+            if (rc->ts / 1e6 > span) {
+                span = rc->ts / 1e6;
+            }
+            if (rc->lost) {
+                nlost++;
+                continue;
+            }
+            drift[ndrift++] = rc->drift_ms;
+            if (!rc->latency) {
+                continue;
+            }
+            if (rc->status != rc->rstatus) {
+                nstatus++;
+            }
+            rec[ncompared] = rc->latency / 1e6;
+            rep[ncompared++] = rc->latency_ms;
+            out += rc->out;
+            rout += rc->rout;
+            if (r->verbose) {
+                printf("%10.2f %10.2f  %s\n", rc->latency / 1e6, rc->latency_ms, rc->line);
+            }
+        }
+    }
+    qsort(rec, ncompared, sizeof(double), cmp_double);
+    qsort(rep, ncompared, sizeof(double), cmp_double);
+    qsort(drift, ndrift, sizeof(double), cmp_double);
+
+    printf("%zu sessions, %zu commands, %zu lost, %zu with another exit status\n", r->nsessions, ncmds, nlost, nstatus);
+    printf("recorded over %.3f s, replayed in %.3f s\n", span / 1e3, (now_ms() - r->start) / 1e3);
+    printf("latency ms    recorded   replayed\n");
+    static const int points[] = {50, 90, 99, 100};
+    for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+        printf("  p%-3d     %11.2f %10.2f\n", points[i], percentile(rec, ncompared, points[i]), percentile(rep, ncompared, points[i]));
+    }
+    printf("start drift ms: p50 %.2f p99 %.2f max %.2f\n",
+        percentile(drift, ndrift, 50), percentile(drift, ndrift, 99), percentile(drift, ndrift, 100));
+    printf("output bytes: recorded %llu, replayed %llu\n", (unsigned long long)out, (unsigned long long)rout);
+    free(rec);
+    free(rep);
+    free(drift);
+}
+
+static int run(replay *r) {
+    r->start = now_ms();
+    while (1) {
+        double now = now_ms(), wake = -1;
+        bool pending = false, feeding = false;
+        for (size_t i = 0; i < r->nsessions; i++) {
+            replay_session *s = &r->sessions[i];
+            double due = replay_submit(r, s, now);
+            if (due >= 0 && (wake < 0 || due < wake)) {
+                wake = due;
+            }
+            if (s->cmd && s->inleft) {
+                replay_input(s);
+                feeding = true;
+            }
+            pending |= s->cmd || s->next < s->ncmds;
+        }
+        if (!pending) {
+            return 0;
+        }
+        // woken up by the connections, the next command due, or to keep input flowing
+        int timeout = feeding ? 1 : wake < 0 ? -1 : (int)(wake - now) + 1;
+        if (unsh_client_process(r->cl, timeout) < 0) {
+            return -1;
+        }
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-s SPEED|-m] [-z] [-v] HOST RECORDFILE\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    replay r = {0};
+    r.speed = 1;
+    bool compress = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:mzv")) != -1) {
+        switch (opt) {
+            case 's':
+                r.speed = strtod(optarg, NULL);
+                if (r.speed <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'm':
+                r.speed = 0;
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'v':
+                r.verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    r.host = argv[optind];
+    if (load(&r, argv[optind + 1]) < 0) {
+        return 1;
+    }
+
+    r.cl = unsh_client_new();
+    unsh_client_set_compress(r.cl, compress);
+    int ret = run(&r);
+    if (ret < 0) {
+        perror("replay failed");
+    }
+    report(&r);
+    unsh_client_free(r.cl);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+// convert an unshd trace dump to the Chrome trace event format, for chrome://tracing or Perfetto
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACEFILE > trace.json\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror("cannot open trace file");
+        return 1;
+    }
+
+    char magic[sizeof(UNSH_TRACE_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, UNSH_TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "not an unshd trace\n");
+        return 1;
+    }
+
+    printf("{\"traceEvents\":[\n");
+    const char *sep = "";
+    unsh_trace_header hdr;
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"unshd %u\"}}", sep, hdr.tid, hdr.tid);
+        sep = ",\n";
+        for (uint32_t i = 0; i < hdr.nevents; i++) {
+            unsh_trace_event ev;
+            if (fread(&ev, sizeof(ev), 1, f) != 1) {
+                fprintf(stderr, "truncated trace\n");
+                return 1;
+            }
+            if (ev.point >= TRACE_MAX) {
+                continue;
+            }
+            printf("%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%u}%s}",
+                sep, unsh_trace_names[ev.point], ev.phase,
+                (unsigned long long)(ev.ts / 1000), (unsigned)(ev.ts % 1000),
+                hdr.tid, ev.arg, ev.phase == 'i' ? ",\"s\":\"t\"" : "");
+        }
+    }
+    printf("\n]}\n");
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "stats.h"
+#include "xfer.h"
+
+unsh_xfer *xfer_new(int fd, off_t offset, int pipesize) {
+    unsh_xfer *x = calloc(1, sizeof(unsh_xfer));
+    x->fd = fd;
+    x->offset = offset;
+    x->pipe[0] = x->pipe[1] = -1;
+    if (pipesize) {
+        if (pipe2(x->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            free(x);
+            return NULL;
+        }
+        // a bigger pipe means fewer splice() round trips, keep the default if refused
+        fcntl(x->pipe[1], F_SETPIPE_SZ, pipesize);
+    }
+    return x;
+}
+
+void xfer_free(unsh_xfer *x) {
+    if (!x) {
+        return;
+    }
+    close(x->fd);
+    if (x->pipe[0] >= 0) {
+        close(x->pipe[0]);
+        close(x->pipe[1]);
+    }
+    free(x);
+}
+
+ssize_t xfer_send(unsh_xfer *x, int sockfd, size_t len) {
+    ssize_t ret = sendfile(sockfd, x->fd, &x->offset, len);
+    if (ret > 0) {
+        stats.xfer_sent += ret;
+    }
+    return ret;
+}
+
+ssize_t xfer_recv(unsh_xfer *x, int sockfd, size_t len) {
+    if (x->err) {
+        char buf[UNSH_BUFSIZE];
+        return read(sockfd, buf, len < UNSH_BUFSIZE ? len : UNSH_BUFSIZE);
+    }
+    ssize_t ret = splice(sockfd, NULL, x->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    // the pipe is drained right away, it never holds more than this round
+    for (ssize_t left = ret; left > 0;) {
+        ssize_t moved = splice(x->pipe[0], NULL, x->fd, &x->offset, left, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            x->err = moved < 0 ? errno : EIO;
+            break;
+        }
+        left -= moved;
+    }
+    if (ret > 0) {
+        stats.xfer_received += ret;
+    }
+    return ret;
+}
+
+int xfer_parse_offset(const char *arg, off_t *offset) {
+    if (!arg) {
+        *offset = 0;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    long long ret = strtoll(arg, &end, 10);
+    if (!*arg || *end || errno || ret < 0) {
+        return -1;
+    }
+    *offset = ret;
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+// file transfer of the "get" and "put" builtins, moved by the kernel without passing through unshd
+typedef struct unsh_xfer {
+    int fd;
+    // put: pipe the socket is spliced into, and drained from to the file
+    int pipe[2];
+    // position in the file
+    off_t offset;
+    // get: bytes left to send, in total and in the current frame, and the frame header
+    off_t left;
+    size_t frameleft;
+    unsigned char hdr[UNSH_FRAME_HDRLEN];
+    uint8_t hdrleft;
+    // put: errno of a failed write, the rest of the input is then dropped
+    int err;
+} unsh_xfer;
+
+// get if pipesize is 0, otherwise put
+unsh_xfer *xfer_new(int fd, off_t offset, int pipesize);
+void xfer_free(unsh_xfer *x);
+// get: send up to len bytes of the file to the socket, like sendfile()
+ssize_t xfer_send(unsh_xfer *x, int sockfd, size_t len);
+// put: move up to len bytes from the socket to the file, returns 0 at the end of input
+// -1 with errno set on socket errors, write errors are only recorded in x->err
+ssize_t xfer_recv(unsh_xfer *x, int sockfd, size_t len);
+// parse an OFFSET argument, NULL is 0
+int xfer_parse_offset(const char *arg, off_t *offset);